@@ -17,12 +17,36 @@
 #ifndef NNKEK_H_
 #define NNKEK_H_
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
 #include <cmath>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <limits>
+#include <mutex>
 #include <random>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #define ASSERT(x)                                                              \
   do {                                                                         \
@@ -60,6 +84,11 @@ template <typename T> T max(T v1, T v2) {
   return v2;
 }
 
+// a * b in *result, or false if it does not fit in a size_t.
+inline bool multiply(size_t a, size_t b, size_t *result) {
+  return !__builtin_mul_overflow(a, b, result);
+}
+
 template <typename T> void swap(T &v1, T &v2) {
   T tmp = v2;
   v2 = v1;
@@ -269,10 +298,11 @@ public:
       }
       free(m_values);
 
-      m_size = other.m_size;
-      setCapacity(m_size);
+      m_values = NULL;
+      m_size = 0;
+      setCapacity(other.m_size);
 
-      for (size_t i = 0; i < m_size; i++) {
+      for (size_t i = 0; i < other.m_size; i++) {
         push(other.m_values[i]);
       }
     }
@@ -316,6 +346,10 @@ public:
 
   size_t size() const { return m_size; }
 
+  T *data() { return m_values; }
+
+  const T *data() const { return m_values; }
+
 private:
   T *m_values;
   size_t m_size;
@@ -326,9 +360,13 @@ private:
 
 namespace Fs {
 
-template <typename F> void readLines(const char *path, F callback) {
+template <typename F> bool readLines(const char *path, F callback) {
   FILE *f = fopen(path, "r");
 
+  if (f == NULL) {
+    return false;
+  }
+
   Container::StringBuilder sb;
 
   while (true) {
@@ -340,7 +378,7 @@ template <typename F> void readLines(const char *path, F callback) {
       if (sb.length() > 0) {
         callback(sb.to_string());
       }
-      break;
+      return true;
     }
 
     char c = ch[0];
@@ -354,329 +392,4930 @@ template <typename F> void readLines(const char *path, F callback) {
   }
 }
 
-} // namespace Fs
-
-namespace Linalg {
-
-template <typename T, size_t ROWS, size_t COLS> class Matrix {
+// Binary files in native byte order. Every call is a no-op once an error has
+// happened, so callers write or read a whole record and check ok() once.
+class Writer {
 public:
-  Matrix() {
-    m_values = static_cast<T *>(malloc(ROWS * COLS * sizeof(T)));
-    for (size_t y = 0; y < ROWS; y++)
-      for (size_t x = 0; x < COLS; x++)
-        operator()(x, y) = 0;
+  explicit Writer(const char *path) {
+    m_file = fopen(path, "wb");
+    m_ok = m_file != NULL;
   }
 
-  Matrix(const Matrix &m) : Matrix() {
-    for (size_t y = 0; y < ROWS; y++)
-      for (size_t x = 0; x < COLS; x++)
-        operator()(x, y) = m(x, y);
+  Writer(const Writer &) = delete;
+  Writer &operator=(const Writer &) = delete;
+
+  ~Writer() { close(); }
+
+  template <typename T> void write(const T &value) { writeArray(&value, 1); }
+
+  template <typename T> void writeArray(const T *values, size_t n) {
+    if (m_ok && n > 0) {
+      m_ok = fwrite(values, sizeof(T), n, m_file) == n;
+    }
   }
 
-  ~Matrix() { free(m_values); }
+  // Pushes everything written so far to the disk.
+  bool sync() {
+    if (m_ok) {
+      m_ok = fflush(m_file) == 0 && fsync(fileno(m_file)) == 0;
+    }
 
-  T &operator()(size_t x, size_t y) {
-    ASSERT(x < COLS);
-    ASSERT(y < ROWS);
-    const size_t index = y * COLS + x;
-    return m_values[index];
+    return m_ok;
   }
 
-  const T &operator()(size_t x, size_t y) const {
-    ASSERT(x < COLS);
-    ASSERT(y < ROWS);
-    const size_t index = y * COLS + x;
-    return m_values[index];
+  bool close() {
+    if (m_file != NULL) {
+      m_ok = fclose(m_file) == 0 && m_ok;
+      m_file = NULL;
+    }
+
+    return m_ok;
   }
 
-  template <size_t OTHER_ROWS, size_t OTHER_COLS>
-  Matrix<T, ROWS, OTHER_COLS>
-  operator*(const Matrix<T, OTHER_ROWS, OTHER_COLS> &other) const {
-    static_assert(COLS == OTHER_ROWS);
+  bool ok() const { return m_ok; }
 
-    Matrix<T, ROWS, OTHER_COLS> m;
+private:
+  FILE *m_file;
+  bool m_ok;
+};
 
-    for (size_t y = 0; y < ROWS; y++)
-      for (size_t x = 0; x < OTHER_COLS; x++)
-        m(x, y) = 0;
+class Reader {
+public:
+  explicit Reader(const char *path) {
+    m_file = fopen(path, "rb");
+    m_ok = m_file != NULL;
+  }
 
-    for (size_t i = 0; i < ROWS; i++)
-      for (size_t j = 0; j < OTHER_COLS; j++)
-        for (size_t k = 0; k < COLS; k++) {
-          m(j, i) = m(j, i) + this->operator()(k, i) * other(j, k);
-        }
+  Reader(const Reader &) = delete;
+  Reader &operator=(const Reader &) = delete;
 
-    return m;
+  ~Reader() {
+    if (m_file != NULL) {
+      fclose(m_file);
+    }
   }
 
-  template <typename L> Matrix<T, ROWS, COLS> operator*(L val) {
-    Matrix<T, ROWS, COLS> result;
+  template <typename T> bool read(T *value) { return readArray(value, 1); }
 
-    for (size_t y = 0; y < ROWS; y++)
-      for (size_t x = 0; x < COLS; x++)
-        result(x, y) *= val;
+  template <typename T> bool readArray(T *values, size_t n) {
+    if (m_ok && n > 0) {
+      m_ok = fread(values, sizeof(T), n, m_file) == n;
+    }
 
-    return result;
+    return m_ok;
   }
 
-  Matrix operator=(const Matrix &other) {
-    for (size_t y = 0; y < ROWS; y++)
-      for (size_t x = 0; x < COLS; x++)
-        operator()(x, y) = other(x, y);
-    return *this;
-  }
+  bool ok() const { return m_ok; }
 
-  void dump() const {
-    for (size_t y = 0; y < ROWS; y++) {
-      printf("[ ");
-      for (size_t x = 0; x < COLS; x++) {
-        printf("%f ", this->operator()(x, y));
-      }
-      printf(" ]\n");
-    }
+  // Bytes between the read position and the end of the file, so sizes read
+  // from the file can be checked before anything is allocated for them.
+  size_t remaining() {
+    if (!m_ok)
+      return 0;
+
+    const long position = ftell(m_file);
+    if (position < 0 || fseek(m_file, 0, SEEK_END) != 0)
+      return 0;
+    const long end = ftell(m_file);
+    m_ok = fseek(m_file, position, SEEK_SET) == 0;
+
+    return m_ok && end > position ? static_cast<size_t>(end - position) : 0;
   }
 
 private:
-  T *m_values;
+  FILE *m_file;
+  bool m_ok;
 };
 
-template <typename T, size_t SIZE> class Vector {
-public:
-  Vector() { m_values = static_cast<T *>(malloc(SIZE * sizeof(T))); }
+} // namespace Fs
 
-  Vector(const Vector &v) {
-    m_values = static_cast<T *>(malloc(SIZE * sizeof(T)));
+namespace Parallel {
 
-    memcpy(m_values, v.m_values, SIZE * sizeof(T));
+// A fixed set of threads that run the tasks [0, n) of one job at a time. Each
+// thread starts on its own contiguous share of the tasks and, once that runs
+// out, steals single tasks from the back of the others' shares, so uneven
+// tasks still keep every thread busy. The calling thread works too, and a job
+// started from inside a task runs inline on that thread.
+class Pool {
+public:
+  // threads counts the caller, so Pool(1) runs everything inline.
+  explicit Pool(size_t threads) {
+    m_threads = Util::max<size_t>(threads, 1);
+    m_shares = new Share[m_threads];
+    m_workers = new std::thread[m_threads - 1];
+
+    for (size_t i = 1; i < m_threads; i++)
+      m_workers[i - 1] = std::thread([this, i]() { loop(i); });
   }
 
-  ~Vector() { free(m_values); }
+  Pool(const Pool &) = delete;
+  Pool &operator=(const Pool &) = delete;
 
-  T &operator[](size_t i) {
-    ASSERT(i < SIZE);
-    return m_values[i];
-  }
+  ~Pool() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_wake.notify_all();
 
-  const T &operator[](size_t i) const {
-    ASSERT(i < SIZE);
-    return m_values[i];
+    for (size_t i = 1; i < m_threads; i++)
+      m_workers[i - 1].join();
+
+    delete[] m_workers;
+    delete[] m_shares;
   }
 
-  Vector<T, SIZE> &operator=(const Vector<T, SIZE> &other) {
-    if (this != &other) {
-      for (size_t i = 0; i < SIZE; i++)
-        operator[](i) = other[i];
+  size_t threads() const { return m_threads; }
+
+  // Calls f(i) for every i in [0, tasks) and returns once all have finished.
+  template <typename F> void run(size_t tasks, F f) {
+    ASSERT(tasks <= UINT32_MAX);
+
+    if (m_threads == 1 || tasks <= 1 || t_inside) {
+      for (size_t i = 0; i < tasks; i++)
+        f(i);
+      return;
     }
-    return *this;
-  }
 
-  template <size_t COLS>
-  Vector<T, COLS> operator*(const Matrix<T, SIZE, COLS> &m) const {
-    Vector<T, COLS> result;
+    std::lock_guard<std::mutex> job(m_job);
+    m_call = [](void *ctx, size_t i) { (*static_cast<F *>(ctx))(i); };
+    m_ctx = &f;
+    m_remaining.store(tasks, std::memory_order_relaxed);
 
-    for (size_t x = 0; x < COLS; x++) {
-      T sum = 0;
-      for (size_t y = 0; y < SIZE; y++) {
-        sum += m(x, y) * this->operator[](y);
-      }
-      result[x] = sum;
+    for (size_t k = 0; k < m_threads; k++) {
+      const uint64_t begin = tasks * k / m_threads;
+      const uint64_t end = tasks * (k + 1) / m_threads;
+      m_shares[k].range.store(begin | end << 32, std::memory_order_release);
     }
 
-    return result;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_generation++;
+    }
+    m_wake.notify_all();
+
+    t_inside = true;
+    work(0);
+    t_inside = false;
+
+    while (m_remaining.load(std::memory_order_acquire) != 0)
+      std::this_thread::yield();
   }
 
-  Vector<T, SIZE> operator-(const Vector<T, SIZE> &other) {
-    Vector<T, SIZE> v = *this;
-    for (size_t i = 0; i < SIZE; i++)
-      v[i] -= other[i];
-    return v;
+  // The pool parallelFor and parallelReduce use by default, with one thread
+  // per core, or NNKEK_THREADS threads if that is set.
+  static Pool &global() {
+    static Pool pool(defaultThreads());
+    return pool;
   }
 
-  T magSq() const {
-    T sum = 0;
-    for (size_t i = 0; i < SIZE; i++)
-      sum += operator[](i) * operator[](i);
-    return sum;
+private:
+  // One thread's tasks as [begin, end), packed so that both ends change with
+  // one compare-and-swap.
+  struct alignas(64) Share {
+    std::atomic<uint64_t> range{0};
+  };
+
+  static size_t defaultThreads() {
+    const char *env = getenv("NNKEK_THREADS");
+    if (env != NULL && atol(env) > 0)
+      return atol(env);
+
+    return std::thread::hardware_concurrency();
   }
 
-  T mag() const { return std::sqrt(magSq()); }
+  // The owner takes tasks from the front of its share.
+  static bool take(Share &share, size_t *task) {
+    uint64_t range = share.range.load(std::memory_order_acquire);
 
-  size_t argmax() const {
-    size_t maxIndex = 0;
-    T max = 0;
+    while (true) {
+      const uint64_t begin = range & UINT32_MAX;
+      const uint64_t end = range >> 32;
+      if (begin >= end)
+        return false;
 
-    for (size_t i = 0; i < SIZE; i++) {
-      if (m_values[i] >= max) {
-        maxIndex = i;
-        max = m_values[i];
+      if (share.range.compare_exchange_weak(range, (begin + 1) | end << 32,
+                                            std::memory_order_acq_rel)) {
+        *task = begin;
+        return true;
       }
     }
-
-    return maxIndex;
   }
 
-  void dump() const {
-    printf("[ ");
-    for (size_t i = 0; i < SIZE; i++) {
-      printf("%f ", this->operator[](i));
+  // Thieves take tasks from the back.
+  static bool steal(Share &share, size_t *task) {
+    uint64_t range = share.range.load(std::memory_order_acquire);
+
+    while (true) {
+      const uint64_t begin = range & UINT32_MAX;
+      const uint64_t end = range >> 32;
+      if (begin >= end)
+        return false;
+
+      if (share.range.compare_exchange_weak(range, begin | (end - 1) << 32,
+                                            std::memory_order_acq_rel)) {
+        *task = end - 1;
+        return true;
+      }
     }
-    printf(" ]\n");
   }
 
-private:
-  T *m_values;
-};
+  void execute(size_t task) {
+    m_call(m_ctx, task);
+    m_remaining.fetch_sub(1, std::memory_order_release);
+  }
 
-} // namespace Linalg
+  void work(size_t self) {
+    size_t task;
+    while (take(m_shares[self], &task))
+      execute(task);
 
-namespace Layer {
+    for (size_t k = 1; k < m_threads; k++) {
+      Share &victim = m_shares[(self + k) % m_threads];
+      while (steal(victim, &task))
+        execute(task);
+    }
+  }
 
-template <typename T, size_t INP, size_t OUT> class Dense {
-public:
-  Dense() : m_matrix() {}
+  void loop(size_t self) {
+    t_inside = true;
+    uint64_t seen = 0;
+
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wake.wait(lock, [&]() { return m_stop || m_generation != seen; });
+        if (m_stop)
+          return;
+        seen = m_generation;
+      }
 
-  Dense(const Dense &other) {
-    m_matrix = Linalg::Matrix<T, INP + 1, OUT>(other.m_matrix);
+      work(self);
+    }
   }
 
-  Linalg::Vector<T, OUT> forward(const Linalg::Vector<T, INP> &input) const {
-    Linalg::Vector<T, INP + 1> v;
-    for (size_t i = 0; i < INP; i++)
-      v[i] = input[i];
+  static thread_local bool t_inside;
 
-    v[INP] = 1;
-    return v * m_matrix;
-  }
+  size_t m_threads;
+  Share *m_shares;
+  std::thread *m_workers;
 
-  Dense operator=(const Dense other) {
-    m_matrix = other.m_matrix;
-    return *this;
-  }
+  std::mutex m_job;
+  void (*m_call)(void *, size_t) = NULL;
+  void *m_ctx = NULL;
+  std::atomic<size_t> m_remaining{0};
 
-  Linalg::Matrix<T, INP + 1, OUT> m_matrix;
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  uint64_t m_generation = 0;
+  bool m_stop = false;
 };
 
-} // namespace Layer
+inline thread_local bool Pool::t_inside = false;
 
-namespace Activation {
+// Parallel loops split [0, n) into at most this many chunks. The split only
+// depends on n, never on the number of threads.
+constexpr size_t maxChunks = 64;
 
-template <typename T, size_t IN>
-Linalg::Vector<T, IN> tanh(const Linalg::Vector<T, IN> &vec) {
-  Linalg::Vector<T, IN> result;
+inline size_t grainFor(size_t n) {
+  return Util::max<size_t>((n + maxChunks - 1) / maxChunks, 1);
+}
 
-  for (size_t i = 0; i < IN; i++) {
-    result[i] = std::tanh(vec[i]);
-  }
+// Calls f(begin, end) over consecutive ranges of at most grain indices that
+// together cover [0, n).
+template <typename F>
+void parallelFor(size_t n, size_t grain, F f, Pool &pool = Pool::global()) {
+  ASSERT(grain > 0);
+  pool.run((n + grain - 1) / grain, [&](size_t c) {
+    f(c * grain, Util::min(n, (c + 1) * grain));
+  });
+}
+
+// combine(identity, map(0), map(1), ..., map(n - 1)), folded left to right
+// within each chunk and then over the chunks in order. The chunks are the
+// same whatever the number of threads, so the result is reproducible to the
+// bit, though it can differ from a plain serial loop for floating point.
+template <typename T, typename M, typename C>
+T parallelReduce(size_t n, T identity, M map, C combine,
+                 Pool &pool = Pool::global()) {
+  const size_t grain = grainFor(n);
+  const size_t chunks = (n + grain - 1) / grain;
+  T partials[maxChunks];
+
+  pool.run(chunks, [&](size_t c) {
+    const size_t end = Util::min(n, (c + 1) * grain);
+    T acc = identity;
+    for (size_t i = c * grain; i < end; i++)
+      acc = combine(acc, map(i));
+    partials[c] = acc;
+  });
+
+  T result = identity;
+  for (size_t c = 0; c < chunks; c++)
+    result = combine(result, partials[c]);
 
   return result;
 }
 
-template <typename T, size_t IN>
-Linalg::Vector<T, IN> relu(const Linalg::Vector<T, IN> &vec) {
-  Linalg::Vector<T, IN> result;
+// Sums map(i) over [0, n), e.g. the error of every sample in a fitness loop.
+template <typename T, typename M>
+T parallelReduce(size_t n, T identity, M map, Pool &pool = Pool::global()) {
+  return parallelReduce(
+      n, identity, map, [](const T &a, const T &b) { return a + b; }, pool);
+}
+
+// Scratch memory private to the calling thread, for temporaries in the body
+// of a parallel loop. It grows as needed and is reused by later calls on the
+// same thread; buffers that are in use at the same time need distinct slots.
+template <typename T> T *scratch(size_t n, size_t slot = 0) {
+  struct Buffers {
+    T *data[4] = {};
+    size_t size[4] = {};
+
+    ~Buffers() {
+      for (size_t i = 0; i < 4; i++)
+        free(data[i]);
+    }
+  };
 
-  for (size_t i = 0; i < IN; i++) {
-    result[i] = vec[i] > 0 ? vec[i] : 0;
+  thread_local Buffers buffers;
+  ASSERT(slot < 4);
+
+  if (buffers.size[slot] < n) {
+    free(buffers.data[slot]);
+    const size_t bytes = (n * sizeof(T) + 63) / 64 * 64;
+    buffers.data[slot] = static_cast<T *>(aligned_alloc(64, bytes));
+    buffers.size[slot] = n;
   }
 
-  return result;
+  return buffers.data[slot];
 }
 
-template <typename T, size_t IN>
-Linalg::Vector<T, IN> fastSigmoid(const Linalg::Vector<T, IN> &vec) {
-  Linalg::Vector<T, IN> result;
+} // namespace Parallel
+
+namespace Simd {
+
+// Packs wrap one native vector register. Every pack type provides load/store,
+// set1, the arithmetic operators and the free functions below, so kernels can
+// be written once and instantiated for the widest ISA the compiler targets.
+// Scalar<T> is both the fallback and the tail handler.
+
+template <typename T> struct Scalar {
+  using Value = T;
+  static constexpr size_t width = 1;
 
-  for (size_t i = 0; i < IN; i++) {
-    result[i] = vec[i] / (1 + abs(vec[i]));
+  static Scalar load(const T *p) { return {*p}; }
+  static Scalar set1(T x) { return {x}; }
+  void store(T *p) const { *p = v; }
+
+  static Scalar gather(const T *base, const int32_t *idx) {
+    return {base[*idx]};
   }
 
-  return result;
+  T v;
+};
+
+template <typename T> Scalar<T> operator+(Scalar<T> a, Scalar<T> b) {
+  return {a.v + b.v};
 }
 
-template <typename T, size_t IN>
-Linalg::Vector<T, IN> softmax(const Linalg::Vector<T, IN> &vec) {
-  Linalg::Vector<T, IN> result;
+template <typename T> Scalar<T> operator-(Scalar<T> a, Scalar<T> b) {
+  return {a.v - b.v};
+}
 
-  T sum = 0;
+template <typename T> Scalar<T> operator*(Scalar<T> a, Scalar<T> b) {
+  return {a.v * b.v};
+}
+
+template <typename T> Scalar<T> operator/(Scalar<T> a, Scalar<T> b) {
+  return {a.v / b.v};
+}
+
+template <typename T> Scalar<T> fmadd(Scalar<T> a, Scalar<T> b, Scalar<T> c) {
+  return {a.v * b.v + c.v};
+}
+
+template <typename T> Scalar<T> max(Scalar<T> a, Scalar<T> b) {
+  return {a.v > b.v ? a.v : b.v};
+}
+
+template <typename T> Scalar<T> min(Scalar<T> a, Scalar<T> b) {
+  return {a.v < b.v ? a.v : b.v};
+}
+
+template <typename T> Scalar<T> abs(Scalar<T> a) { return {std::abs(a.v)}; }
+
+template <typename T> Scalar<T> copysign(Scalar<T> mag, Scalar<T> sign) {
+  return {std::copysign(mag.v, sign.v)};
+}
+
+// The scalar path, used for tails and tiny layers, defers to libm: it is
+// exact to within an ulp and has a shorter dependency chain than the
+// polynomial below for a handful of elements. Evaluating the polynomial with
+// plain scalar arithmetic would also let -ffast-math re-associate the
+// Cody-Waite reduction.
+template <typename T> Scalar<T> exp(Scalar<T> a) { return {std::exp(a.v)}; }
+
+template <typename T> Scalar<T> tanh(Scalar<T> a) { return {std::tanh(a.v)}; }
+
+template <typename T> T reduceAdd(Scalar<T> a) { return a.v; }
+
+template <typename T> T reduceMax(Scalar<T> a) { return a.v; }
 
-  for (size_t i = 0; i < IN; i++) {
-    sum += std::exp(vec[i]);
+#if defined(__AVX2__)
+
+struct F32x8 {
+  using Value = float;
+  static constexpr size_t width = 8;
+
+  static F32x8 load(const float *p) { return {_mm256_loadu_ps(p)}; }
+  static F32x8 set1(float x) { return {_mm256_set1_ps(x)}; }
+  void store(float *p) const { _mm256_storeu_ps(p, v); }
+
+  static F32x8 gather(const float *base, const int32_t *idx) {
+    const __m256i i = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx));
+    const __m256 all = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    return {_mm256_mask_i32gather_ps(_mm256_setzero_ps(), base, i, all, 4)};
   }
 
-  for (size_t i = 0; i < IN; i++) {
-    result[i] = std::exp(vec[i]) / sum;
+  __m256 v;
+};
+
+struct F64x4 {
+  using Value = double;
+  static constexpr size_t width = 4;
+
+  static F64x4 load(const double *p) { return {_mm256_loadu_pd(p)}; }
+  static F64x4 set1(double x) { return {_mm256_set1_pd(x)}; }
+  void store(double *p) const { _mm256_storeu_pd(p, v); }
+
+  static F64x4 gather(const double *base, const int32_t *idx) {
+    const __m128i i = _mm_loadu_si128(reinterpret_cast<const __m128i *>(idx));
+    const __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+    return {_mm256_mask_i32gather_pd(_mm256_setzero_pd(), base, i, all, 8)};
   }
 
-  return result;
+  __m256d v;
+};
+
+inline F32x8 operator+(F32x8 a, F32x8 b) { return {_mm256_add_ps(a.v, b.v)}; }
+inline F32x8 operator-(F32x8 a, F32x8 b) { return {_mm256_sub_ps(a.v, b.v)}; }
+inline F32x8 operator*(F32x8 a, F32x8 b) { return {_mm256_mul_ps(a.v, b.v)}; }
+inline F32x8 operator/(F32x8 a, F32x8 b) { return {_mm256_div_ps(a.v, b.v)}; }
+
+inline F32x8 fmadd(F32x8 a, F32x8 b, F32x8 c) {
+#if defined(__FMA__)
+  return {_mm256_fmadd_ps(a.v, b.v, c.v)};
+#else
+  return a * b + c;
+#endif
 }
 
-} // namespace Activation
+inline F32x8 max(F32x8 a, F32x8 b) { return {_mm256_max_ps(a.v, b.v)}; }
+inline F32x8 min(F32x8 a, F32x8 b) { return {_mm256_min_ps(a.v, b.v)}; }
 
-namespace Mutation {
+inline F32x8 abs(F32x8 a) {
+  return {_mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v)};
+}
 
-template <typename T, size_t ROWS, size_t COLS>
-void testMutate(Linalg::Matrix<T, ROWS, COLS> *matrix, float rate = 0.5) {
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::uniform_real_distribution<> dis(-10, 10);
-  std::uniform_real_distribution<> prob(0, 1);
+inline F32x8 copysign(F32x8 mag, F32x8 sign) {
+  const __m256 mask = _mm256_set1_ps(-0.0f);
+  return {_mm256_or_ps(_mm256_andnot_ps(mask, mag.v),
+                       _mm256_and_ps(mask, sign.v))};
+}
 
-  for (size_t y = 0; y < ROWS; y++) {
-    for (size_t x = 0; x < COLS; x++) {
-      if (prob(gen) < rate) {
-        matrix->operator()(x, y) = dis(gen);
-      }
-    }
-  }
+inline F32x8 round(F32x8 a) {
+  return {_mm256_round_ps(a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)};
 }
 
-template <typename T, size_t ROWS, size_t COLS>
-void normalMutate(Linalg::Matrix<T, ROWS, COLS> *matrix, float stddev) {
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::normal_distribution<> normal(0, stddev);
+inline F32x8 pow2n(F32x8 n) {
+  const __m256 biased = _mm256_add_ps(n.v, _mm256_set1_ps(12582912.0f + 127));
+  return {_mm256_castsi256_ps(
+      _mm256_slli_epi32(_mm256_castps_si256(biased), 23))};
+}
 
-  for (size_t y = 0; y < ROWS; y++) {
-    for (size_t x = 0; x < COLS; x++) {
-      matrix->operator()(x, y) += normal(gen);
-    }
-  }
+inline float reduceAdd(F32x8 a) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(a.v),
+                        _mm256_extractf128_ps(a.v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
 }
 
-template <typename T, size_t ROWS, size_t COLS>
-void normalMutate(Linalg::Matrix<T, ROWS, COLS> *matrix, float rate,
-                  float stddev) {
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::uniform_real_distribution<> prob(0, 1);
-  std::normal_distribution<> normal(0, stddev);
+inline float reduceMax(F32x8 a) {
+  __m128 s = _mm_max_ps(_mm256_castps256_ps128(a.v),
+                        _mm256_extractf128_ps(a.v, 1));
+  s = _mm_max_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_max_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
 
-  for (size_t y = 0; y < ROWS; y++) {
-    for (size_t x = 0; x < COLS; x++) {
-      if (prob(gen) < rate) {
-        matrix->operator()(x, y) += normal(gen);
-      }
-    }
-  }
+inline F64x4 operator+(F64x4 a, F64x4 b) { return {_mm256_add_pd(a.v, b.v)}; }
+inline F64x4 operator-(F64x4 a, F64x4 b) { return {_mm256_sub_pd(a.v, b.v)}; }
+inline F64x4 operator*(F64x4 a, F64x4 b) { return {_mm256_mul_pd(a.v, b.v)}; }
+inline F64x4 operator/(F64x4 a, F64x4 b) { return {_mm256_div_pd(a.v, b.v)}; }
+
+inline F64x4 fmadd(F64x4 a, F64x4 b, F64x4 c) {
+#if defined(__FMA__)
+  return {_mm256_fmadd_pd(a.v, b.v, c.v)};
+#else
+  return a * b + c;
+#endif
 }
 
-template <typename T, typename F, size_t ROWS, size_t COLS>
-void costMutate(Linalg::Matrix<T, ROWS, COLS> *matrix, F f, T stddev) {
-  size_t y = Util::random_range((size_t)0, ROWS);
-  size_t x = Util::random_range((size_t)0, COLS);
-  std::normal_distribution<> normalDist{0, stddev};
-  T diff = normalDist(gen);
+inline F64x4 max(F64x4 a, F64x4 b) { return {_mm256_max_pd(a.v, b.v)}; }
+inline F64x4 min(F64x4 a, F64x4 b) { return {_mm256_min_pd(a.v, b.v)}; }
 
-  auto cost = f();
-  matrix->operator()(x, y) += diff;
-  auto costPos = f();
+inline F64x4 abs(F64x4 a) {
+  return {_mm256_andnot_pd(_mm256_set1_pd(-0.0), a.v)};
+}
 
-  if (costPos > cost) {
-    matrix->operator()(x, y) -= diff;
+inline F64x4 copysign(F64x4 mag, F64x4 sign) {
+  const __m256d mask = _mm256_set1_pd(-0.0);
+  return {_mm256_or_pd(_mm256_andnot_pd(mask, mag.v),
+                       _mm256_and_pd(mask, sign.v))};
+}
+
+inline F64x4 round(F64x4 a) {
+  return {_mm256_round_pd(a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)};
+}
+
+inline F64x4 pow2n(F64x4 n) {
+  const __m256d biased =
+      _mm256_add_pd(n.v, _mm256_set1_pd(6755399441055744.0 + 1023));
+  return {_mm256_castsi256_pd(
+      _mm256_slli_epi64(_mm256_castpd_si256(biased), 52))};
+}
+
+inline double reduceAdd(F64x4 a) {
+  __m128d s = _mm_add_pd(_mm256_castpd256_pd128(a.v),
+                         _mm256_extractf128_pd(a.v, 1));
+  s = _mm_add_sd(s, _mm_unpackhi_pd(s, s));
+  return _mm_cvtsd_f64(s);
+}
+
+inline double reduceMax(F64x4 a) {
+  __m128d s = _mm_max_pd(_mm256_castpd256_pd128(a.v),
+                         _mm256_extractf128_pd(a.v, 1));
+  s = _mm_max_sd(s, _mm_unpackhi_pd(s, s));
+  return _mm_cvtsd_f64(s);
+}
+
+#endif
+
+#if defined(__AVX512F__)
+
+// GCC 12 reports -Wmaybe-uninitialized inside the unmasked AVX-512 intrinsics
+// once they are inlined under -flto, where diagnostic pragmas no longer
+// apply. The masked forms with an all-ones mask compile to the same
+// instructions without tripping it.
+
+struct F32x16 {
+  using Value = float;
+  static constexpr size_t width = 16;
+
+  static F32x16 load(const float *p) { return {_mm512_loadu_ps(p)}; }
+  static F32x16 set1(float x) { return {_mm512_set1_ps(x)}; }
+  void store(float *p) const { _mm512_storeu_ps(p, v); }
+
+  static F32x16 gather(const float *base, const int32_t *idx) {
+    return {_mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xffff,
+                                     _mm512_loadu_si512(idx), base, 4)};
+  }
+
+  __m512 v;
+};
+
+struct F64x8 {
+  using Value = double;
+  static constexpr size_t width = 8;
+
+  static F64x8 load(const double *p) { return {_mm512_loadu_pd(p)}; }
+  static F64x8 set1(double x) { return {_mm512_set1_pd(x)}; }
+  void store(double *p) const { _mm512_storeu_pd(p, v); }
+
+  static F64x8 gather(const double *base, const int32_t *idx) {
+    const __m256i i = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx));
+    return {_mm512_mask_i32gather_pd(_mm512_setzero_pd(), 0xff, i, base, 8)};
   }
+
+  __m512d v;
+};
+
+inline F32x16 operator+(F32x16 a, F32x16 b) { return {_mm512_add_ps(a.v, b.v)}; }
+inline F32x16 operator-(F32x16 a, F32x16 b) { return {_mm512_sub_ps(a.v, b.v)}; }
+inline F32x16 operator*(F32x16 a, F32x16 b) { return {_mm512_mul_ps(a.v, b.v)}; }
+inline F32x16 operator/(F32x16 a, F32x16 b) { return {_mm512_div_ps(a.v, b.v)}; }
+
+inline F32x16 fmadd(F32x16 a, F32x16 b, F32x16 c) {
+  return {_mm512_fmadd_ps(a.v, b.v, c.v)};
 }
 
-} // namespace Mutation
+inline F32x16 max(F32x16 a, F32x16 b) {
+  return {_mm512_mask_max_ps(a.v, 0xffff, a.v, b.v)};
+}
+
+inline F32x16 min(F32x16 a, F32x16 b) {
+  return {_mm512_mask_min_ps(a.v, 0xffff, a.v, b.v)};
+}
+
+inline F32x16 abs(F32x16 a) { return {_mm512_abs_ps(a.v)}; }
+
+inline F32x16 copysign(F32x16 mag, F32x16 sign) {
+  const __m512i mask = _mm512_castps_si512(_mm512_set1_ps(-0.0f));
+  return {_mm512_castsi512_ps(_mm512_ternarylogic_epi32(
+      mask, _mm512_castps_si512(sign.v), _mm512_castps_si512(mag.v), 0xca))};
+}
+
+inline F32x16 round(F32x16 a) {
+  return {_mm512_mask_roundscale_ps(a.v, 0xffff, a.v,
+                                    _MM_FROUND_TO_NEAREST_INT)};
+}
+
+inline F32x16 pow2n(F32x16 n) {
+  const __m512i biased = _mm512_castps_si512(
+      _mm512_add_ps(n.v, _mm512_set1_ps(12582912.0f + 127)));
+  return {_mm512_castsi512_ps(
+      _mm512_mask_slli_epi32(biased, 0xffff, biased, 23))};
+}
+
+template <int HALF> __m256d half(__m512d a) {
+  return _mm512_mask_extractf64x4_pd(_mm256_setzero_pd(), 0xf, a, HALF);
+}
+
+template <int HALF> __m256 half(__m512 a) {
+  return _mm256_castpd_ps(half<HALF>(_mm512_castps_pd(a)));
+}
+
+inline float reduceAdd(F32x16 a) {
+  return reduceAdd(F32x8{_mm256_add_ps(half<0>(a.v), half<1>(a.v))});
+}
+
+inline float reduceMax(F32x16 a) {
+  return reduceMax(F32x8{_mm256_max_ps(half<0>(a.v), half<1>(a.v))});
+}
+
+inline F64x8 operator+(F64x8 a, F64x8 b) { return {_mm512_add_pd(a.v, b.v)}; }
+inline F64x8 operator-(F64x8 a, F64x8 b) { return {_mm512_sub_pd(a.v, b.v)}; }
+inline F64x8 operator*(F64x8 a, F64x8 b) { return {_mm512_mul_pd(a.v, b.v)}; }
+inline F64x8 operator/(F64x8 a, F64x8 b) { return {_mm512_div_pd(a.v, b.v)}; }
+
+inline F64x8 fmadd(F64x8 a, F64x8 b, F64x8 c) {
+  return {_mm512_fmadd_pd(a.v, b.v, c.v)};
+}
+
+inline F64x8 max(F64x8 a, F64x8 b) {
+  return {_mm512_mask_max_pd(a.v, 0xff, a.v, b.v)};
+}
+
+inline F64x8 min(F64x8 a, F64x8 b) {
+  return {_mm512_mask_min_pd(a.v, 0xff, a.v, b.v)};
+}
+
+inline F64x8 abs(F64x8 a) { return {_mm512_abs_pd(a.v)}; }
+
+inline F64x8 copysign(F64x8 mag, F64x8 sign) {
+  const __m512i mask = _mm512_castpd_si512(_mm512_set1_pd(-0.0));
+  return {_mm512_castsi512_pd(_mm512_ternarylogic_epi64(
+      mask, _mm512_castpd_si512(sign.v), _mm512_castpd_si512(mag.v), 0xca))};
+}
+
+inline F64x8 round(F64x8 a) {
+  return {_mm512_mask_roundscale_pd(a.v, 0xff, a.v, _MM_FROUND_TO_NEAREST_INT)};
+}
+
+inline F64x8 pow2n(F64x8 n) {
+  const __m512i biased = _mm512_castpd_si512(
+      _mm512_add_pd(n.v, _mm512_set1_pd(6755399441055744.0 + 1023)));
+  return {_mm512_castsi512_pd(
+      _mm512_mask_slli_epi64(biased, 0xff, biased, 52))};
+}
+
+inline double reduceAdd(F64x8 a) {
+  return reduceAdd(F64x4{_mm256_add_pd(half<0>(a.v), half<1>(a.v))});
+}
+
+inline double reduceMax(F64x8 a) {
+  return reduceMax(F64x4{_mm256_max_pd(half<0>(a.v), half<1>(a.v))});
+}
+
+#endif
+
+template <typename T> struct Native { using Type = Scalar<T>; };
+
+#if defined(__AVX512F__)
+template <> struct Native<float> { using Type = F32x16; };
+template <> struct Native<double> { using Type = F64x8; };
+#elif defined(__AVX2__)
+template <> struct Native<float> { using Type = F32x8; };
+template <> struct Native<double> { using Type = F64x4; };
+#endif
+
+template <typename T> using Pack = typename Native<T>::Type;
+
+// 2^n for integral n inside the normal exponent range is built by adding n to
+// 1.5 * 2^mantissa_bits plus the exponent bias and shifting the low mantissa
+// bits into the exponent field.
+//
+// exp(x) = 2^n * exp(r) with n = round(x / ln2) and |r| <= ln2 / 2, where
+// ln2 is split in two parts (Cody-Waite) so that r is exact. exp(r) is
+// 1 + r + r^2 * p(r).
+//
+// double: p is the degree 10 Taylor polynomial, truncation error below
+// 2e-16. Measured max relative error over [-708, 709] is 5e-16.
+//
+// float: p is the Cephes expf minimax polynomial. Measured max relative
+// error over [-87, 88] is 1.2e-7.
+//
+// Inputs are clamped to [lo, hi], so exp never returns 0 or inf.
+template <typename T> struct ExpConst {
+  static constexpr T lo = -708;
+  static constexpr T hi = 709;
+  static constexpr T log2e = 1.4426950408889634;
+  static constexpr T ln2Hi = 6.93145751953125e-1;
+  static constexpr T ln2Lo = 1.42860682030941723212e-6;
+  static constexpr size_t degree = 11;
+  static constexpr T poly[degree] = {
+      1.0 / 479001600, 1.0 / 39916800, 1.0 / 3628800, 1.0 / 362880,
+      1.0 / 40320,     1.0 / 5040,     1.0 / 720,     1.0 / 120,
+      1.0 / 24,        1.0 / 6,        1.0 / 2};
+};
+
+template <> struct ExpConst<float> {
+  static constexpr float lo = -87.3365447504019f;
+  static constexpr float hi = 88.3762626647949f;
+  static constexpr float log2e = 1.44269504088896341f;
+  static constexpr float ln2Hi = 0.693359375f;
+  static constexpr float ln2Lo = -2.12194440e-4f;
+  static constexpr size_t degree = 6;
+  static constexpr float poly[degree] = {
+      1.9875691500e-4f, 1.3981999507e-3f, 8.3334519073e-3f,
+      4.1665795894e-2f, 1.6666665459e-1f, 5.0000001201e-1f};
+};
+
+template <typename P, typename T = typename P::Value> P exp(P x) {
+  using C = ExpConst<T>;
+
+  x = min(max(x, P::set1(C::lo)), P::set1(C::hi));
+  const P n = round(x * P::set1(C::log2e));
+  P r = fmadd(n, P::set1(-C::ln2Hi), x);
+  r = fmadd(n, P::set1(-C::ln2Lo), r);
+
+  P p = P::set1(C::poly[0]);
+  for (size_t i = 1; i < C::degree; i++)
+    p = fmadd(p, r, P::set1(C::poly[i]));
+
+  return fmadd(p, r * r, r + P::set1(1)) * pow2n(n);
+}
+
+// tanh(x) = sign(x) * (1 - 2 / (exp(2|x|) + 1)). The error is absolute, not
+// relative: measured max absolute error is 2.5e-7 for float and 3e-16 for
+// double. Values very close to zero lose their relative precision.
+template <typename P, typename T = typename P::Value> P tanh(P x) {
+  const P a = abs(x);
+  const P e = exp(a + a);
+  return copysign(P::set1(1) - P::set1(2) / (e + P::set1(1)), x);
+}
+
+template <typename T, typename F> void map(const T *in, T *out, size_t n, F f) {
+  using P = Pack<T>;
+  const size_t body = n - n % P::width;
+
+  for (size_t i = 0; i < body; i += P::width)
+    f(P::load(in + i)).store(out + i);
+  for (size_t i = body; i < n; i++)
+    f(Scalar<T>::load(in + i)).store(out + i);
+}
+
+template <typename T> T sum(const T *in, size_t n) {
+  using P = Pack<T>;
+  const size_t body = n - n % P::width;
+
+  P acc = P::set1(0);
+  for (size_t i = 0; i < body; i += P::width)
+    acc = acc + P::load(in + i);
+
+  T result = reduceAdd(acc);
+  for (size_t i = body; i < n; i++)
+    result += in[i];
+  return result;
+}
+
+template <typename T> T maximum(const T *in, size_t n) {
+  ASSERT(n > 0);
+  using P = Pack<T>;
+  const size_t body = n - n % P::width;
+
+  T result = in[0];
+  if (body > 0) {
+    P acc = P::load(in);
+    for (size_t i = P::width; i < body; i += P::width)
+      acc = max(acc, P::load(in + i));
+    result = reduceMax(acc);
+  }
+
+  for (size_t i = body; i < n; i++)
+    result = in[i] > result ? in[i] : result;
+  return result;
+}
+
+template <typename T> void scale(T *inout, size_t n, T factor) {
+  map(inout, inout, n, [factor](auto x) {
+    using P = decltype(x);
+    return x * P::set1(factor);
+  });
+}
+
+template <typename T> void exp(const T *in, T *out, size_t n) {
+  map(in, out, n, [](auto x) { return exp(x); });
+}
+
+template <typename T> void tanh(const T *in, T *out, size_t n) {
+  map(in, out, n, [](auto x) { return tanh(x); });
+}
+
+template <typename T> void relu(const T *in, T *out, size_t n) {
+  map(in, out, n, [](auto x) {
+    using P = decltype(x);
+    return max(x, P::set1(0));
+  });
+}
+
+template <typename T> void fastSigmoid(const T *in, T *out, size_t n) {
+  map(in, out, n, [](auto x) {
+    using P = decltype(x);
+    return x / (P::set1(1) + abs(x));
+  });
+}
+
+// Numerically stable softmax. The maximum is subtracted before
+// exponentiation so large logits cannot overflow; every exp is evaluated once
+// and the normalisation is a single extra pass.
+template <typename T> void softmax(const T *in, T *out, size_t n) {
+  using P = Pack<T>;
+
+  const T m = maximum(in, n);
+  const P pm = P::set1(m);
+
+  const size_t body = n - n % P::width;
+
+  P acc = P::set1(0);
+  for (size_t i = 0; i < body; i += P::width) {
+    const P e = exp(P::load(in + i) - pm);
+    e.store(out + i);
+    acc = acc + e;
+  }
+
+  T total = reduceAdd(acc);
+  for (size_t i = body; i < n; i++) {
+    const Scalar<T> e = exp(Scalar<T>::load(in + i) - Scalar<T>::set1(m));
+    e.store(out + i);
+    total += e.v;
+  }
+
+  scale(out, n, T(1) / total);
+}
+
+// y += a * x
+template <typename T> void axpy(T a, const T *x, T *y, size_t n) {
+  using P = Pack<T>;
+  const size_t body = n - n % P::width;
+  const P pa = P::set1(a);
+
+  for (size_t i = 0; i < body; i += P::width)
+    fmadd(pa, P::load(x + i), P::load(y + i)).store(y + i);
+  for (size_t i = body; i < n; i++)
+    y[i] += a * x[i];
+}
+
+// out = v * m for a row-major rows x cols matrix. Accumulating whole rows
+// keeps every access contiguous.
+template <typename T>
+void vecMat(const T *v, const T *m, T *out, size_t rows, size_t cols) {
+  memset(out, 0, cols * sizeof(T));
+  for (size_t r = 0; r < rows; r++)
+    axpy(v[r], m + r * cols, out, cols);
+}
+
+// The dense layer kernel. w is row-major with inputs + 1 rows of outputs
+// columns; the last row is the bias.
+template <typename T>
+void affine(const T *in, const T *w, T *out, size_t inputs, size_t outputs) {
+  memcpy(out, w + inputs * outputs, outputs * sizeof(T));
+  for (size_t r = 0; r < inputs; r++)
+    axpy(in[r], w + r * outputs, out, outputs);
+}
+
+// affine() over batch rows of in. Four samples share every load of a weight
+// panel, so the weights are streamed a quarter as often as row by row.
+template <typename T>
+void affineBatch(const T *in, const T *w, T *out, size_t batch, size_t inputs,
+                 size_t outputs) {
+  using P = Pack<T>;
+  const size_t body = outputs - outputs % P::width;
+  const T *bias = w + inputs * outputs;
+
+  size_t b = 0;
+  for (; b + 4 <= batch; b += 4) {
+    const T *x0 = in + b * inputs;
+    const T *x1 = x0 + inputs;
+    const T *x2 = x1 + inputs;
+    const T *x3 = x2 + inputs;
+    T *y = out + b * outputs;
+
+    for (size_t o = 0; o < body; o += P::width) {
+      P acc0 = P::load(bias + o);
+      P acc1 = acc0;
+      P acc2 = acc0;
+      P acc3 = acc0;
+
+      for (size_t r = 0; r < inputs; r++) {
+        const P wr = P::load(w + r * outputs + o);
+        acc0 = fmadd(P::set1(x0[r]), wr, acc0);
+        acc1 = fmadd(P::set1(x1[r]), wr, acc1);
+        acc2 = fmadd(P::set1(x2[r]), wr, acc2);
+        acc3 = fmadd(P::set1(x3[r]), wr, acc3);
+      }
+
+      acc0.store(y + o);
+      acc1.store(y + outputs + o);
+      acc2.store(y + 2 * outputs + o);
+      acc3.store(y + 3 * outputs + o);
+    }
+
+    for (size_t o = body; o < outputs; o++) {
+      T acc0 = bias[o], acc1 = bias[o], acc2 = bias[o], acc3 = bias[o];
+      for (size_t r = 0; r < inputs; r++) {
+        const T wr = w[r * outputs + o];
+        acc0 += x0[r] * wr;
+        acc1 += x1[r] * wr;
+        acc2 += x2[r] * wr;
+        acc3 += x3[r] * wr;
+      }
+      y[o] = acc0;
+      y[outputs + o] = acc1;
+      y[2 * outputs + o] = acc2;
+      y[3 * outputs + o] = acc3;
+    }
+  }
+
+  for (; b < batch; b++)
+    affine(in + b * inputs, w, out + b * outputs, inputs, outputs);
+}
+
+template <typename T> T dot(const T *a, const T *b, size_t n) {
+  using P = Pack<T>;
+  const size_t body = n - n % P::width;
+
+  P acc = P::set1(0);
+  for (size_t i = 0; i < body; i += P::width)
+    acc = fmadd(P::load(a + i), P::load(b + i), acc);
+
+  T result = reduceAdd(acc);
+  for (size_t i = body; i < n; i++)
+    result += a[i] * b[i];
+  return result;
+}
+
+// out = m * v for a row-major rows x cols matrix, one dot product per row.
+template <typename T>
+void matVec(const T *m, const T *v, T *out, size_t rows, size_t cols) {
+  for (size_t r = 0; r < rows; r++)
+    out[r] = dot(m + r * cols, v, cols);
+}
+
+// affine() for output-major weights: every output has a row of inputs
+// weights followed by its bias. Four neurons share every load of the input.
+template <typename T>
+void affineTransposed(const T *in, const T *w, T *out, size_t inputs,
+                      size_t outputs) {
+  using P = Pack<T>;
+  const size_t body = inputs - inputs % P::width;
+  const size_t stride = inputs + 1;
+
+  // Too few inputs to fill a pack. Plain loops let the compiler vectorize
+  // across neurons instead.
+  if (body == 0) {
+    for (size_t o = 0; o < outputs; o++) {
+      const T *row = w + o * stride;
+      T y = row[inputs];
+      for (size_t i = 0; i < inputs; i++)
+        y += row[i] * in[i];
+      out[o] = y;
+    }
+    return;
+  }
+
+  size_t o = 0;
+  for (; o + 4 <= outputs; o += 4) {
+    const T *w0 = w + o * stride;
+    const T *w1 = w0 + stride;
+    const T *w2 = w1 + stride;
+    const T *w3 = w2 + stride;
+
+    P acc0 = P::set1(0);
+    P acc1 = acc0;
+    P acc2 = acc0;
+    P acc3 = acc0;
+
+    for (size_t i = 0; i < body; i += P::width) {
+      const P x = P::load(in + i);
+      acc0 = fmadd(P::load(w0 + i), x, acc0);
+      acc1 = fmadd(P::load(w1 + i), x, acc1);
+      acc2 = fmadd(P::load(w2 + i), x, acc2);
+      acc3 = fmadd(P::load(w3 + i), x, acc3);
+    }
+
+    T y0 = w0[inputs] + reduceAdd(acc0);
+    T y1 = w1[inputs] + reduceAdd(acc1);
+    T y2 = w2[inputs] + reduceAdd(acc2);
+    T y3 = w3[inputs] + reduceAdd(acc3);
+    for (size_t i = body; i < inputs; i++) {
+      y0 += w0[i] * in[i];
+      y1 += w1[i] * in[i];
+      y2 += w2[i] * in[i];
+      y3 += w3[i] * in[i];
+    }
+
+    out[o] = y0;
+    out[o + 1] = y1;
+    out[o + 2] = y2;
+    out[o + 3] = y3;
+  }
+
+  for (; o < outputs; o++)
+    out[o] = w[o * stride + inputs] + dot(w + o * stride, in, inputs);
+}
+
+// sum(values[k] * x[indices[k]]), the row kernel of a CSR matrix.
+template <typename T>
+T sparseDot(const T *values, const int32_t *indices, size_t n, const T *x) {
+  using P = Pack<T>;
+  const size_t body = n - n % P::width;
+
+  P acc = P::set1(0);
+  for (size_t i = 0; i < body; i += P::width)
+    acc = fmadd(P::load(values + i), P::gather(x, indices + i), acc);
+
+  T result = reduceAdd(acc);
+  for (size_t i = body; i < n; i++)
+    result += values[i] * x[indices[i]];
+  return result;
+}
+
+} // namespace Simd
+
+namespace Linalg {
+
+// Elementwise arithmetic on Vector and Matrix is lazy: a - b only records
+// what to compute. Assigning the result to a Vector or Matrix, or reducing it
+// with sum(), magSq() or dot(), then runs one vectorized pass over the
+// operands, so (target - result).magSq() needs no temporary vector.
+//
+// Expressions hold pointers to their operands and must not outlive them;
+// use them within one statement rather than keeping them in an auto.
+namespace Expr {
+
+template <typename T> struct Leaf {
+  T at(size_t i) const { return values[i]; }
+
+  template <typename P> P pack(size_t i) const { return P::load(values + i); }
+
+  const T *values;
+};
+
+template <typename T> struct Broadcast {
+  T at(size_t) const { return value; }
+
+  template <typename P> P pack(size_t) const { return P::set1(value); }
+
+  T value;
+};
+
+struct Add {
+  template <typename X> static X apply(X a, X b) { return a + b; }
+};
+
+struct Sub {
+  template <typename X> static X apply(X a, X b) { return a - b; }
+};
+
+struct Mul {
+  template <typename X> static X apply(X a, X b) { return a * b; }
+};
+
+struct Div {
+  template <typename X> static X apply(X a, X b) { return a / b; }
+};
+
+template <typename Op, typename L, typename R> struct Binary {
+  auto at(size_t i) const { return Op::apply(l.at(i), r.at(i)); }
+
+  template <typename P> P pack(size_t i) const {
+    return Op::apply(l.template pack<P>(i), r.template pack<P>(i));
+  }
+
+  L l;
+  R r;
+};
+
+template <typename T, typename E> void evaluate(const E &e, T *out, size_t n) {
+  using P = Simd::Pack<T>;
+  const size_t body = n - n % P::width;
+
+  for (size_t i = 0; i < body; i += P::width)
+    e.template pack<P>(i).store(out + i);
+  for (size_t i = body; i < n; i++)
+    out[i] = e.at(i);
+}
+
+// Folds the elements of e with f(acc, x), where f takes packs of any width.
+template <typename T, typename E, typename F>
+T fold(const E &e, size_t n, F f) {
+  using P = Simd::Pack<T>;
+  using S = Simd::Scalar<T>;
+  const size_t body = n - n % P::width;
+
+  P acc = P::set1(0);
+  for (size_t i = 0; i < body; i += P::width)
+    acc = f(acc, e.template pack<P>(i));
+
+  S tail = S::set1(reduceAdd(acc));
+  for (size_t i = body; i < n; i++)
+    tail = f(tail, e.template pack<S>(i));
+  return tail.v;
+}
+
+} // namespace Expr
+
+template <typename C, typename E> class Lazy {
+public:
+  using Value = typename C::Value;
+
+  explicit Lazy(const E &e) : m_expr(e) {}
+
+  const E &expr() const { return m_expr; }
+
+  Value operator[](size_t i) const {
+    ASSERT(i < C::elements);
+    return m_expr.at(i);
+  }
+
+  void evaluate(Value *out) const {
+    Expr::evaluate<Value>(m_expr, out, C::elements);
+  }
+
+  C eval() const { return C(*this); }
+
+  Value sum() const {
+    return Expr::fold<Value>(m_expr, C::elements,
+                             [](auto acc, auto x) { return acc + x; });
+  }
+
+  Value magSq() const {
+    return Expr::fold<Value>(m_expr, C::elements,
+                             [](auto acc, auto x) { return fmadd(x, x, acc); });
+  }
+
+  Value mag() const { return std::sqrt(magSq()); }
+
+private:
+  E m_expr;
+};
+
+// The values of a Matrix or Tensor. Copies share one reference-counted
+// block, and the first write through a copy that is not the only user gives
+// it a private block. A population cloned from one parent therefore only
+// pays for the layers each child actually mutates.
+//
+// A view wraps values owned by someone else, e.g. a Model::Genome. It is
+// never shared: copying a view copies its values.
+template <typename T> class Storage {
+public:
+  static constexpr size_t alignment = 64;
+
+  Storage() {}
+
+  // size zeroed values, aligned to alignment bytes.
+  explicit Storage(size_t size) {
+    ASSERT(allocate(size));
+    memset(m_values, 0, size * sizeof(T));
+  }
+
+  // The same, or none if the memory is not there, for sizes that come from
+  // outside the program such as a model file.
+  static Container::Option<Storage> zeroed(size_t size) {
+    Storage storage;
+    if (!storage.allocate(size))
+      return Container::Option<Storage>();
+
+    memset(storage.m_values, 0, size * sizeof(T));
+    return Container::Option<Storage>(storage);
+  }
+
+  Storage(const Storage &other) { share(other); }
+
+  Storage(Storage &&other) { steal(other); }
+
+  ~Storage() { release(); }
+
+  Storage &operator=(const Storage &other) {
+    if (this != &other && m_values != other.m_values) {
+      release();
+      share(other);
+    }
+
+    return *this;
+  }
+
+  Storage &operator=(Storage &&other) {
+    if (this != &other) {
+      release();
+      steal(other);
+    }
+
+    return *this;
+  }
+
+  void view(T *values, size_t size) {
+    release();
+    m_values = values;
+    m_size = size;
+  }
+
+  bool isView() const { return m_block == NULL && m_values != NULL; }
+
+  size_t size() const { return m_size; }
+
+  // How many Storages share the block; 0 for a view.
+  size_t users() const {
+    return m_block == NULL ? 0 : m_block->users.load(std::memory_order_relaxed);
+  }
+
+  const T *read() const { return m_values; }
+
+  T *write() {
+    if (m_block != NULL) {
+      if (m_block->users.load(std::memory_order_acquire) > 1)
+        detach();
+      modified();
+    }
+
+    return m_values;
+  }
+
+  // Tells stamp() that the values changed. write() does it by itself, but a
+  // pointer kept from an earlier write() can be written to after a stamp()
+  // was taken; whoever writes through it must call modified() before the
+  // next stamp(). The Mutation overloads for Matrix and Tensor do.
+  void modified() {
+    if (m_block != NULL)
+      m_block->dirty.store(true, std::memory_order_relaxed);
+  }
+
+  // Changes whenever the values may have changed, so equal stamps mean equal
+  // values, as long as writes through kept pointers are followed by
+  // modified(). Views have no block to track and always get a fresh stamp.
+  uint64_t stamp() const {
+    static std::atomic<uint64_t> next(1);
+
+    if (m_block == NULL)
+      return next.fetch_add(1, std::memory_order_relaxed);
+
+    if (m_block->dirty.exchange(false, std::memory_order_relaxed))
+      m_block->stamp = next.fetch_add(1, std::memory_order_relaxed);
+    return m_block->stamp;
+  }
+
+private:
+  struct alignas(alignment) Block {
+    std::atomic<size_t> users;
+    std::atomic<bool> dirty;
+    uint64_t stamp;
+  };
+
+  // Returns false, leaving the storage empty, if size values do not fit in
+  // memory.
+  bool allocate(size_t size) {
+    size_t bytes = 0;
+    if (!Util::multiply(size, sizeof(T), &bytes) ||
+        bytes > SIZE_MAX - sizeof(Block) - alignment)
+      return false;
+
+    bytes = sizeof(Block) + (bytes + alignment - 1) / alignment * alignment;
+    Block *block = static_cast<Block *>(aligned_alloc(alignment, bytes));
+    if (block == NULL)
+      return false;
+
+    m_block = block;
+    new (&m_block->users) std::atomic<size_t>(1);
+    new (&m_block->dirty) std::atomic<bool>(true);
+    m_block->stamp = 0;
+    m_values = reinterpret_cast<T *>(m_block + 1);
+    m_size = size;
+    return true;
+  }
+
+  void share(const Storage &other) {
+    if (other.m_block == NULL) {
+      ASSERT(allocate(other.m_size));
+      if (m_size > 0)
+        memcpy(m_values, other.m_values, m_size * sizeof(T));
+      return;
+    }
+
+    other.m_block->users.fetch_add(1, std::memory_order_relaxed);
+    m_block = other.m_block;
+    m_values = other.m_values;
+    m_size = other.m_size;
+  }
+
+  void steal(Storage &other) {
+    m_block = other.m_block;
+    m_values = other.m_values;
+    m_size = other.m_size;
+    other.m_block = NULL;
+    other.m_values = NULL;
+    other.m_size = 0;
+  }
+
+  void detach() {
+    Block *shared = m_block;
+    const T *values = m_values;
+    ASSERT(allocate(m_size));
+    if (m_size > 0)
+      memcpy(m_values, values, m_size * sizeof(T));
+    if (shared->users.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      free(shared);
+  }
+
+  void release() {
+    if (m_block != NULL &&
+        m_block->users.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      free(m_block);
+
+    m_block = NULL;
+    m_values = NULL;
+    m_size = 0;
+  }
+
+  Block *m_block = NULL;
+  T *m_values = NULL;
+  size_t m_size = 0;
+};
+
+// How a Matrix lays out its values. RowMajor keeps each row contiguous,
+// ColumnMajor each column. operator() and the operators are the same for
+// both; only code that touches data() directly sees the difference.
+enum class Order { RowMajor, ColumnMajor };
+
+template <typename T, size_t ROWS, size_t COLS, Order ORDER = Order::RowMajor>
+class Matrix {
+public:
+  using Value = T;
+  static constexpr size_t elements = ROWS * COLS;
+  static constexpr Order order = ORDER;
+
+  Matrix() : m_storage(ROWS * COLS) {}
+
+  // Copies share their values until one of them writes, see Storage.
+  Matrix(const Matrix &) = default;
+
+  // The same matrix in the other storage order.
+  template <Order OTHER>
+  explicit Matrix(const Matrix<T, ROWS, COLS, OTHER> &other)
+      : m_storage(ROWS * COLS) {
+    const T *from = other.data();
+    T *to = m_storage.write();
+    for (size_t y = 0; y < ROWS; y++)
+      for (size_t x = 0; x < COLS; x++)
+        to[index(x, y)] = from[Matrix<T, ROWS, COLS, OTHER>::index(x, y)];
+  }
+
+  template <typename E>
+  Matrix(const Lazy<Matrix, E> &e) : m_storage(ROWS * COLS) {
+    e.evaluate(m_storage.write());
+  }
+
+  // Makes the matrix a view of ROWS * COLS values owned by someone else,
+  // e.g. a Model::Genome. Copies of the matrix own their values again.
+  void view(T *values) { m_storage.view(values, ROWS * COLS); }
+
+  // Position of column x of row y in data().
+  static constexpr size_t index(size_t x, size_t y) {
+    return ORDER == Order::RowMajor ? y * COLS + x : x * ROWS + y;
+  }
+
+  T &operator()(size_t x, size_t y) {
+    ASSERT(x < COLS);
+    ASSERT(y < ROWS);
+    return m_storage.write()[index(x, y)];
+  }
+
+  const T &operator()(size_t x, size_t y) const {
+    ASSERT(x < COLS);
+    ASSERT(y < ROWS);
+    return m_storage.read()[index(x, y)];
+  }
+
+  T *data() { return m_storage.write(); }
+
+  const T *data() const { return m_storage.read(); }
+
+  // See Storage::modified.
+  void modified() { m_storage.modified(); }
+
+  const Storage<T> &storage() const { return m_storage; }
+
+  template <size_t OTHER_ROWS, size_t OTHER_COLS, Order OTHER>
+  Matrix<T, ROWS, OTHER_COLS, ORDER>
+  operator*(const Matrix<T, OTHER_ROWS, OTHER_COLS, OTHER> &other) const {
+    static_assert(COLS == OTHER_ROWS);
+
+    Matrix<T, ROWS, OTHER_COLS, ORDER> m;
+
+    for (size_t i = 0; i < ROWS; i++)
+      for (size_t j = 0; j < OTHER_COLS; j++)
+        for (size_t k = 0; k < COLS; k++) {
+          m(j, i) = m(j, i) + this->operator()(k, i) * other(j, k);
+        }
+
+    return m;
+  }
+
+  // Shares other's values, except that a view keeps its place and takes a
+  // copy of them.
+  Matrix operator=(const Matrix &other) {
+    if (!m_storage.isView())
+      m_storage = other.m_storage;
+    else if (other.data() != m_storage.read())
+      memcpy(m_storage.write(), other.data(), ROWS * COLS * sizeof(T));
+    return *this;
+  }
+
+  template <typename E> Matrix &operator=(const Lazy<Matrix, E> &e) {
+    e.evaluate(m_storage.write());
+    return *this;
+  }
+
+  void dump() const {
+    for (size_t y = 0; y < ROWS; y++) {
+      printf("[ ");
+      for (size_t x = 0; x < COLS; x++) {
+        printf("%f ", this->operator()(x, y));
+      }
+      printf(" ]\n");
+    }
+  }
+
+private:
+  Storage<T> m_storage;
+};
+
+// Small vectors keep their values inline, so the activations of tiny layers
+// live on the stack (or in registers) instead of costing a malloc per
+// forward pass.
+template <typename T, size_t SIZE> class Vector {
+public:
+  using Value = T;
+  static constexpr size_t elements = SIZE;
+  static constexpr bool onHeap = SIZE * sizeof(T) > 256;
+
+  Vector() {
+    allocate();
+    memset(m_values, 0, SIZE * sizeof(T));
+  }
+
+  Vector(const Vector &v) {
+    allocate();
+    memcpy(m_values, v.m_values, SIZE * sizeof(T));
+  }
+
+  template <typename E> Vector(const Lazy<Vector, E> &e) {
+    allocate();
+    e.evaluate(m_values);
+  }
+
+  ~Vector() {
+    if constexpr (onHeap) {
+      free(m_values);
+    }
+  }
+
+  T &operator[](size_t i) {
+    ASSERT(i < SIZE);
+    return m_values[i];
+  }
+
+  const T &operator[](size_t i) const {
+    ASSERT(i < SIZE);
+    return m_values[i];
+  }
+
+  T *data() { return m_values; }
+
+  const T *data() const { return m_values; }
+
+  Vector<T, SIZE> &operator=(const Vector<T, SIZE> &other) {
+    if (this != &other) {
+      for (size_t i = 0; i < SIZE; i++)
+        operator[](i) = other[i];
+    }
+    return *this;
+  }
+
+  template <typename E> Vector &operator=(const Lazy<Vector, E> &e) {
+    e.evaluate(m_values);
+    return *this;
+  }
+
+  // A column-major matrix is walked one contiguous column per output.
+  template <size_t COLS, Order ORDER>
+  Vector<T, COLS> operator*(const Matrix<T, SIZE, COLS, ORDER> &m) const {
+    Vector<T, COLS> result;
+    if constexpr (ORDER == Order::RowMajor)
+      Simd::vecMat(m_values, m.data(), result.data(), SIZE, COLS);
+    else
+      Simd::matVec(m.data(), m_values, result.data(), COLS, SIZE);
+    return result;
+  }
+
+  T sum() const { return lazy().sum(); }
+
+  T magSq() const { return lazy().magSq(); }
+
+  T mag() const { return lazy().mag(); }
+
+  size_t argmax() const {
+    size_t maxIndex = 0;
+    T max = 0;
+
+    for (size_t i = 0; i < SIZE; i++) {
+      if (m_values[i] >= max) {
+        maxIndex = i;
+        max = m_values[i];
+      }
+    }
+
+    return maxIndex;
+  }
+
+  void dump() const {
+    printf("[ ");
+    for (size_t i = 0; i < SIZE; i++) {
+      printf("%f ", this->operator[](i));
+    }
+    printf(" ]\n");
+  }
+
+private:
+  Lazy<Vector, Expr::Leaf<T>> lazy() const {
+    return Lazy<Vector, Expr::Leaf<T>>({m_values});
+  }
+
+  void allocate() {
+    if constexpr (onHeap) {
+      m_values = static_cast<T *>(malloc(SIZE * sizeof(T)));
+    }
+  }
+
+  typename std::conditional<onHeap, T *, T[SIZE]>::type m_values;
+};
+
+// What the elementwise operators accept: a Vector, a Matrix or an expression
+// built from them. Both sides of a binary operator must have the same
+// container type. Matrix * Matrix stays the matrix product.
+template <typename X> struct Operand {};
+
+template <typename T, size_t SIZE> struct Operand<Vector<T, SIZE>> {
+  using Container = Vector<T, SIZE>;
+  static constexpr bool elementwiseMul = true;
+  static Expr::Leaf<T> get(const Container &v) { return {v.data()}; }
+};
+
+template <typename T, size_t ROWS, size_t COLS, Order ORDER>
+struct Operand<Matrix<T, ROWS, COLS, ORDER>> {
+  using Container = Matrix<T, ROWS, COLS, ORDER>;
+  static constexpr bool elementwiseMul = false;
+  static Expr::Leaf<T> get(const Container &m) { return {m.data()}; }
+};
+
+template <typename C, typename E> struct Operand<Lazy<C, E>> {
+  using Container = C;
+  static constexpr bool elementwiseMul = Operand<C>::elementwiseMul;
+  static const E &get(const Lazy<C, E> &e) { return e.expr(); }
+};
+
+template <typename A, typename B>
+using IfSameShape = typename std::enable_if<
+    std::is_same<typename Operand<A>::Container,
+                 typename Operand<B>::Container>::value>::type;
+
+template <typename A, typename S>
+using IfScalar = typename std::enable_if<std::is_arithmetic<S>::value,
+                                         typename Operand<A>::Container>::type;
+
+template <typename A>
+using ExprOf = typename std::decay<decltype(Operand<A>::get(
+    std::declval<const A &>()))>::type;
+
+template <typename Op, typename A, typename B>
+Expr::Binary<Op, ExprOf<A>, ExprOf<B>> node(const A &a, const B &b) {
+  return {Operand<A>::get(a), Operand<B>::get(b)};
+}
+
+template <typename Op, typename A, typename B>
+auto combine(const A &a, const B &b) {
+  return Lazy<typename Operand<A>::Container, Expr::Binary<Op, ExprOf<A>,
+                                                           ExprOf<B>>>(
+      node<Op>(a, b));
+}
+
+template <typename Op, typename A, typename S>
+auto combineScalar(const A &a, S s) {
+  using C = typename Operand<A>::Container;
+  using T = typename C::Value;
+  return Lazy<C, Expr::Binary<Op, ExprOf<A>, Expr::Broadcast<T>>>(
+      {Operand<A>::get(a), {static_cast<T>(s)}});
+}
+
+template <typename A, typename B, typename = IfSameShape<A, B>>
+auto operator+(const A &a, const B &b) {
+  return combine<Expr::Add>(a, b);
+}
+
+template <typename A, typename B, typename = IfSameShape<A, B>>
+auto operator-(const A &a, const B &b) {
+  return combine<Expr::Sub>(a, b);
+}
+
+template <typename A, typename B, typename = IfSameShape<A, B>,
+          typename = typename std::enable_if<Operand<A>::elementwiseMul>::type>
+auto operator*(const A &a, const B &b) {
+  return combine<Expr::Mul>(a, b);
+}
+
+template <typename A, typename S, typename = IfScalar<A, S>>
+auto operator+(const A &a, S s) {
+  return combineScalar<Expr::Add>(a, s);
+}
+
+template <typename A, typename S, typename = IfScalar<A, S>>
+auto operator-(const A &a, S s) {
+  return combineScalar<Expr::Sub>(a, s);
+}
+
+template <typename A, typename S, typename = IfScalar<A, S>>
+auto operator*(const A &a, S s) {
+  return combineScalar<Expr::Mul>(a, s);
+}
+
+template <typename A, typename S, typename = IfScalar<A, S>>
+auto operator*(S s, const A &a) {
+  return combineScalar<Expr::Mul>(a, s);
+}
+
+template <typename A, typename S, typename = IfScalar<A, S>>
+auto operator/(const A &a, S s) {
+  return combineScalar<Expr::Div>(a, s);
+}
+
+// The sum of the elementwise products, in one pass.
+template <typename A, typename B, typename = IfSameShape<A, B>>
+auto dot(const A &a, const B &b) {
+  using C = typename Operand<A>::Container;
+  auto add = [](auto acc, auto x) { return acc + x; };
+  return Expr::fold<typename C::Value>(node<Expr::Mul>(a, b), C::elements, add);
+}
+
+template <typename T> class Tensor {
+public:
+  static constexpr size_t maxRank = 4;
+  static constexpr size_t alignment = 64;
+
+  Tensor() {
+    m_rank = 0;
+    m_size = 0;
+  }
+
+  template <typename... Dims> explicit Tensor(size_t dim, Dims... dims) {
+    static_assert(sizeof...(Dims) < maxRank);
+    const size_t shape[] = {dim, static_cast<size_t>(dims)...};
+    allocate(sizeof...(Dims) + 1, shape);
+  }
+
+  // Copies share their values until one of them writes, see Storage.
+  Tensor(const Tensor &other) : m_storage(other.m_storage) {
+    setShape(other.m_rank, other.m_shape);
+  }
+
+  Tensor(Tensor &&other) { take(other); }
+
+  Tensor &operator=(const Tensor &other) {
+    if (this == &other)
+      return *this;
+
+    if (m_storage.isView() && sameShape(other)) {
+      if (other.data() != m_storage.read())
+        memcpy(m_storage.write(), other.data(), m_size * sizeof(T));
+    } else {
+      m_storage = other.m_storage;
+      setShape(other.m_rank, other.m_shape);
+    }
+
+    return *this;
+  }
+
+  Tensor &operator=(Tensor &&other) {
+    if (this != &other)
+      take(other);
+
+    return *this;
+  }
+
+  // A zeroed tensor with the given runtime rank and shape.
+  static Tensor withShape(size_t rank, const size_t *shape) {
+    Tensor t;
+    t.allocate(rank, shape);
+    return t;
+  }
+
+  // A zeroed tensor with the same shape as other.
+  static Tensor like(const Tensor &other) {
+    return withShape(other.m_rank, other.m_shape);
+  }
+
+  // withShape for shapes read from a file: none if the size overflows or the
+  // memory is not there.
+  static Container::Option<Tensor> tryWithShape(size_t rank,
+                                                const size_t *shape) {
+    size_t size = rank > 0 ? 1 : 0;
+    for (size_t i = 0; i < rank; i++)
+      if (!Util::multiply(size, shape[i], &size))
+        return Container::Option<Tensor>();
+
+    auto storage = Storage<T>::zeroed(size);
+    if (!storage.is_some())
+      return Container::Option<Tensor>();
+
+    Tensor t;
+    t.setShape(rank, shape);
+    t.m_storage = storage.value();
+    return Container::Option<Tensor>(t);
+  }
+
+  // Makes the tensor a view of size() values owned by someone else, e.g. a
+  // Model::Genome. Assigning a tensor of the same shape writes through to
+  // them; copies own their values again.
+  void view(T *values) { m_storage.view(values, m_size); }
+
+  size_t rank() const { return m_rank; }
+
+  size_t shape(size_t dim) const {
+    ASSERT(dim < m_rank);
+    return m_shape[dim];
+  }
+
+  size_t stride(size_t dim) const {
+    ASSERT(dim < m_rank);
+    return m_strides[dim];
+  }
+
+  size_t size() const { return m_size; }
+
+  bool sameShape(const Tensor &other) const {
+    if (m_rank != other.m_rank)
+      return false;
+
+    for (size_t i = 0; i < m_rank; i++)
+      if (m_shape[i] != other.m_shape[i])
+        return false;
+
+    return true;
+  }
+
+  T *data() { return m_storage.write(); }
+
+  const T *data() const { return m_storage.read(); }
+
+  // See Storage::modified.
+  void modified() { m_storage.modified(); }
+
+  const Storage<T> &storage() const { return m_storage; }
+
+  T &operator[](size_t i) {
+    ASSERT(i < m_size);
+    return data()[i];
+  }
+
+  const T &operator[](size_t i) const {
+    ASSERT(i < m_size);
+    return data()[i];
+  }
+
+  template <typename... Idx> T &operator()(Idx... idx) {
+    return data()[offset(idx...)];
+  }
+
+  template <typename... Idx> const T &operator()(Idx... idx) const {
+    return data()[offset(idx...)];
+  }
+
+  // The i-th slice along the first dimension, e.g. one sample of a batch.
+  T *row(size_t i) {
+    ASSERT(m_rank > 0 && i < m_shape[0]);
+    return data() + i * m_strides[0];
+  }
+
+  const T *row(size_t i) const {
+    ASSERT(m_rank > 0 && i < m_shape[0]);
+    return data() + i * m_strides[0];
+  }
+
+  void dump() const {
+    const size_t cols = m_rank == 0 ? 0 : m_shape[m_rank - 1];
+    for (size_t i = 0; i < m_size; i += cols) {
+      printf("[ ");
+      for (size_t x = 0; x < cols; x++) {
+        printf("%f ", static_cast<double>(data()[i + x]));
+      }
+      printf(" ]\n");
+    }
+  }
+
+private:
+  void setShape(size_t rank, const size_t *shape) {
+    ASSERT(rank <= maxRank);
+
+    m_rank = rank;
+    m_size = 1;
+    for (size_t i = rank; i-- > 0;) {
+      m_shape[i] = shape[i];
+      m_strides[i] = m_size;
+      m_size *= shape[i];
+    }
+
+    if (rank == 0)
+      m_size = 0;
+  }
+
+  void allocate(size_t rank, const size_t *shape) {
+    setShape(rank, shape);
+    m_storage = Storage<T>(m_size);
+  }
+
+  void take(Tensor &other) {
+    m_storage = std::move(other.m_storage);
+    setShape(other.m_rank, other.m_shape);
+    other.m_rank = 0;
+    other.m_size = 0;
+  }
+
+  template <typename... Idx> size_t offset(Idx... idx) const {
+    ASSERT(sizeof...(Idx) == m_rank);
+    const size_t index[] = {static_cast<size_t>(idx)...};
+
+    size_t result = 0;
+    for (size_t i = 0; i < sizeof...(Idx); i++) {
+      ASSERT(index[i] < m_shape[i]);
+      result += index[i] * m_strides[i];
+    }
+
+    return result;
+  }
+
+  Storage<T> m_storage;
+  size_t m_rank;
+  size_t m_size;
+  size_t m_shape[maxRank] = {};
+  size_t m_strides[maxRank] = {};
+};
+
+} // namespace Linalg
+
+namespace Layer {
+
+// Storage order of a Dense weight matrix, (INP + 1) x OUT with the bias row
+// last. Output-major (ColumnMajor) storage gives every neuron a contiguous run
+// of INP weights followed by its bias, so its output is one dot product. That
+// wins once the inputs fill a vector register and the outputs do not; wider
+// layers are faster input-major, where every input is one axpy over all the
+// outputs.
+//
+// The choice depends on the shape alone, with a 64-byte register standing in
+// for the real one. Genome, Farm and Checkpoint copy m_matrix.data() as it
+// is, so builds for different ISAs must agree on the layout.
+template <typename T>
+constexpr Linalg::Order denseOrder(size_t inputs, size_t outputs) {
+  constexpr size_t width = 64 / sizeof(T);
+  return inputs >= width && outputs < width ? Linalg::Order::ColumnMajor
+                                            : Linalg::Order::RowMajor;
+}
+
+// The forward pass of a Dense layer in either storage order. With the shape
+// known at compile time the compiler already unrolls the loops of tiny
+// layers, and bench/dense found no shape where a hand-unrolled kernel won.
+template <typename T, size_t INP, size_t OUT,
+          Linalg::Order ORDER = denseOrder<T>(INP, OUT)>
+struct DenseKernel {
+  static void forward(const T *in, const T *w, T *out) {
+    if constexpr (ORDER == Linalg::Order::RowMajor)
+      Simd::affine(in, w, out, INP, OUT);
+    else
+      Simd::affineTransposed(in, w, out, INP, OUT);
+  }
+};
+
+// ORDER defaults to the faster layout for the shape, see denseOrder. Files
+// always hold the input-major layout of DynamicDense, so save() and load()
+// transpose output-major weights.
+template <typename T, size_t INP, size_t OUT,
+          Linalg::Order ORDER = denseOrder<T>(INP, OUT)>
+class Dense {
+public:
+  using Weights = Linalg::Matrix<T, INP + 1, OUT, ORDER>;
+  using RowMajor = Linalg::Matrix<T, INP + 1, OUT>;
+
+  Dense() : m_matrix() {}
+
+  Dense(const Dense &other) : m_matrix(other.m_matrix) {}
+
+  Linalg::Vector<T, OUT> forward(const Linalg::Vector<T, INP> &input) const {
+    Linalg::Vector<T, OUT> result;
+    DenseKernel<T, INP, OUT, ORDER>::forward(input.data(), m_matrix.data(),
+                                             result.data());
+    return result;
+  }
+
+  Dense operator=(const Dense other) {
+    m_matrix = other.m_matrix;
+    return *this;
+  }
+
+  void save(Fs::Writer &w) const {
+    const RowMajor rows(m_matrix);
+    w.writeArray(rows.data(), (INP + 1) * OUT);
+  }
+
+  bool load(Fs::Reader &r) {
+    RowMajor rows;
+    if (!r.readArray(rows.data(), (INP + 1) * OUT))
+      return false;
+    m_matrix = Weights(rows);
+    return true;
+  }
+
+  Weights m_matrix;
+};
+
+// Dense layer with its shape chosen at runtime. Its weights are input-major,
+// (inputs + 1) x outputs row-major with the bias row last, which suits the
+// batched kernel, and no code is instantiated per shape.
+template <typename T> class DynamicDense {
+public:
+  DynamicDense() : m_matrix() {}
+
+  DynamicDense(size_t inputs, size_t outputs) : m_matrix(inputs + 1, outputs) {}
+
+  size_t inputs() const { return m_matrix.shape(0) - 1; }
+
+  size_t outputs() const { return m_matrix.shape(1); }
+
+  // Accepts a single sample of shape {inputs} or a batch of shape
+  // {batch, inputs}, and returns {outputs} or {batch, outputs}.
+  Linalg::Tensor<T> forward(const Linalg::Tensor<T> &input) const {
+    ASSERT(input.rank() == 1 || input.rank() == 2);
+    ASSERT(input.shape(input.rank() - 1) == inputs());
+
+    const size_t batch = input.rank() == 1 ? 1 : input.shape(0);
+    Linalg::Tensor<T> result = input.rank() == 1
+                                   ? Linalg::Tensor<T>(outputs())
+                                   : Linalg::Tensor<T>(batch, outputs());
+
+    Simd::affineBatch(input.data(), m_matrix.data(), result.data(), batch,
+                      inputs(), outputs());
+
+    return result;
+  }
+
+  void save(Fs::Writer &w) const {
+    w.write(static_cast<uint64_t>(inputs()));
+    w.write(static_cast<uint64_t>(outputs()));
+    w.writeArray(m_matrix.data(), m_matrix.size());
+  }
+
+  bool load(Fs::Reader &r) {
+    uint64_t inputs = 0;
+    uint64_t outputs = 0;
+    if (!r.read(&inputs) || !r.read(&outputs) || inputs == SIZE_MAX)
+      return false;
+
+    // The shape is checked against what the file still holds before
+    // anything is allocated for it.
+    const size_t shape[] = {static_cast<size_t>(inputs) + 1,
+                            static_cast<size_t>(outputs)};
+    size_t bytes = 0;
+    if (!Util::multiply(shape[0], shape[1], &bytes) ||
+        !Util::multiply(bytes, sizeof(T), &bytes) || bytes > r.remaining())
+      return false;
+
+    auto matrix = Linalg::Tensor<T>::tryWithShape(2, shape);
+    if (!matrix.is_some())
+      return false;
+
+    m_matrix = matrix.value();
+    return r.readArray(m_matrix.data(), m_matrix.size());
+  }
+
+  Linalg::Tensor<T> m_matrix;
+};
+
+// Dense layer in compressed sparse row form, one row per output neuron. Only
+// the non-zero input weights are stored; the biases stay dense. The sparsity
+// pattern is fixed when the layer is built (usually from a pruned dense
+// layer), so mutating parameters() only ever moves surviving weights.
+template <typename T> class SparseDense {
+public:
+  SparseDense() {
+    m_inputs = 0;
+    m_outputs = 0;
+    m_rowStart.push(0);
+  }
+
+  // w has the DynamicDense layout: (inputs + 1) x outputs, bias row last.
+  SparseDense(const T *w, size_t inputs, size_t outputs) {
+    m_inputs = inputs;
+    m_outputs = outputs;
+    m_rowStart.push(0);
+
+    for (size_t o = 0; o < outputs; o++) {
+      for (size_t i = 0; i < inputs; i++) {
+        const T value = w[i * outputs + o];
+        if (value != 0) {
+          m_indices.push(static_cast<int32_t>(i));
+          m_params.push(value);
+        }
+      }
+      m_rowStart.push(m_indices.size());
+    }
+
+    for (size_t o = 0; o < outputs; o++)
+      m_params.push(w[inputs * outputs + o]);
+  }
+
+  template <size_t INP, size_t OUT, Linalg::Order ORDER>
+  explicit SparseDense(const Dense<T, INP, OUT, ORDER> &dense)
+      : SparseDense(
+            typename Dense<T, INP, OUT, ORDER>::RowMajor(dense.m_matrix).data(),
+            INP, OUT) {}
+
+  explicit SparseDense(const DynamicDense<T> &dense)
+      : SparseDense(dense.m_matrix.data(), dense.inputs(), dense.outputs()) {}
+
+  size_t inputs() const { return m_inputs; }
+
+  size_t outputs() const { return m_outputs; }
+
+  size_t nonZeros() const { return m_indices.size(); }
+
+  // 0 for a layer without weights.
+  double sparsity() const {
+    if (m_inputs * m_outputs == 0)
+      return 0;
+    return 1 - static_cast<double>(nonZeros()) / (m_inputs * m_outputs);
+  }
+
+  // The surviving weights row by row, followed by the biases.
+  Container::Vector<T> &parameters() { return m_params; }
+
+  const Container::Vector<T> &parameters() const { return m_params; }
+
+  void forward(const T *in, T *out) const {
+    const T *values = m_params.data();
+    const T *bias = values + nonZeros();
+    const int32_t *indices = m_indices.data();
+    const size_t *rowStart = m_rowStart.data();
+
+    for (size_t o = 0; o < m_outputs; o++) {
+      const size_t begin = rowStart[o];
+      out[o] = bias[o] + Simd::sparseDot(values + begin, indices + begin,
+                                         rowStart[o + 1] - begin, in);
+    }
+  }
+
+  // Same shapes as DynamicDense::forward.
+  Linalg::Tensor<T> forward(const Linalg::Tensor<T> &input) const {
+    ASSERT(input.rank() == 1 || input.rank() == 2);
+    ASSERT(input.shape(input.rank() - 1) == m_inputs);
+
+    const size_t batch = input.rank() == 1 ? 1 : input.shape(0);
+    Linalg::Tensor<T> result = input.rank() == 1
+                                   ? Linalg::Tensor<T>(m_outputs)
+                                   : Linalg::Tensor<T>(batch, m_outputs);
+
+    for (size_t i = 0; i < batch; i++)
+      forward(input.data() + i * m_inputs, result.data() + i * m_outputs);
+
+    return result;
+  }
+
+  DynamicDense<T> toDense() const {
+    DynamicDense<T> dense(m_inputs, m_outputs);
+    T *w = dense.m_matrix.data();
+
+    for (size_t o = 0; o < m_outputs; o++) {
+      for (size_t k = m_rowStart[o]; k < m_rowStart[o + 1]; k++)
+        w[m_indices[k] * m_outputs + o] = m_params[k];
+      w[m_inputs * m_outputs + o] = m_params[nonZeros() + o];
+    }
+
+    return dense;
+  }
+
+  void save(Fs::Writer &w) const {
+    w.write(static_cast<uint64_t>(m_inputs));
+    w.write(static_cast<uint64_t>(m_outputs));
+    for (size_t o = 0; o < m_outputs; o++)
+      w.write(static_cast<uint32_t>(m_rowStart[o + 1] - m_rowStart[o]));
+    w.writeArray(m_indices.data(), m_indices.size());
+    w.writeArray(m_params.data(), m_params.size());
+  }
+
+  bool load(Fs::Reader &r) {
+    uint64_t inputs = 0;
+    uint64_t outputs = 0;
+    if (!r.read(&inputs) || !r.read(&outputs) ||
+        outputs > r.remaining() / sizeof(uint32_t))
+      return false;
+
+    SparseDense layer;
+    layer.m_inputs = inputs;
+    layer.m_outputs = outputs;
+
+    for (size_t o = 0; o < outputs; o++) {
+      uint32_t count = 0;
+      if (!r.read(&count) || count > inputs)
+        return false;
+      layer.m_rowStart.push(layer.m_rowStart[o] + count);
+    }
+
+    // Every index and value must still be in the file.
+    const size_t nnz = layer.m_rowStart[outputs];
+    const size_t remaining = r.remaining();
+    if (nnz > remaining / (sizeof(int32_t) + sizeof(T)) ||
+        nnz * sizeof(int32_t) + (nnz + outputs) * sizeof(T) > remaining)
+      return false;
+
+    for (size_t k = 0; k < nnz; k++) {
+      int32_t index = 0;
+      if (!r.read(&index) || index < 0 || static_cast<size_t>(index) >= inputs)
+        return false;
+      layer.m_indices.push(index);
+    }
+
+    for (size_t k = 0; k < nnz + outputs; k++) {
+      T value = 0;
+      if (!r.read(&value))
+        return false;
+      layer.m_params.push(value);
+    }
+
+    *this = layer;
+    return true;
+  }
+
+private:
+  size_t m_inputs;
+  size_t m_outputs;
+  Container::Vector<size_t> m_rowStart;
+  Container::Vector<int32_t> m_indices;
+  Container::Vector<T> m_params;
+};
+
+} // namespace Layer
+
+namespace Prune {
+
+// Magnitude pruning of a DynamicDense-layout weight matrix, (inputs + 1) x
+// outputs row-major with the bias row last. Biases are never pruned. Both
+// passes return the number of input weights left, and the result can be
+// turned into a Layer::SparseDense.
+
+// Zeroes every weight with |w| < threshold.
+template <typename T>
+size_t magnitude(T *w, size_t inputs, size_t outputs, T threshold) {
+  size_t kept = 0;
+
+  for (size_t i = 0; i < inputs * outputs; i++) {
+    if (std::abs(w[i]) < threshold) {
+      w[i] = 0;
+    } else if (w[i] != 0) {
+      kept++;
+    }
+  }
+
+  return kept;
+}
+
+// Keeps the k largest magnitude input weights of every neuron.
+template <typename T> size_t topK(T *w, size_t inputs, size_t outputs, size_t k) {
+  if (k >= inputs)
+    return magnitude(w, inputs, outputs, T(0));
+
+  Container::Vector<size_t> order;
+  for (size_t i = 0; i < inputs; i++)
+    order.push(i);
+
+  size_t kept = 0;
+  for (size_t o = 0; o < outputs; o++) {
+    size_t *first = order.data();
+    std::nth_element(first, first + k, first + inputs, [=](size_t a, size_t b) {
+      return std::abs(w[a * outputs + o]) > std::abs(w[b * outputs + o]);
+    });
+
+    for (size_t i = k; i < inputs; i++)
+      w[first[i] * outputs + o] = 0;
+    for (size_t i = 0; i < k; i++)
+      kept += w[first[i] * outputs + o] != 0;
+  }
+
+  return kept;
+}
+
+// An output-major neuron is an INP x 1 matrix followed by its bias, so the
+// Dense overloads prune it one neuron at a time.
+template <typename T, size_t INP, size_t OUT, Linalg::Order ORDER>
+size_t magnitude(Layer::Dense<T, INP, OUT, ORDER> *layer, T threshold) {
+  T *w = layer->m_matrix.data();
+  if constexpr (ORDER == Linalg::Order::RowMajor)
+    return magnitude(w, INP, OUT, threshold);
+
+  size_t kept = 0;
+  for (size_t o = 0; o < OUT; o++)
+    kept += magnitude(w + o * (INP + 1), INP, 1, threshold);
+  return kept;
+}
+
+template <typename T>
+size_t magnitude(Layer::DynamicDense<T> *layer, T threshold) {
+  return magnitude(layer->m_matrix.data(), layer->inputs(), layer->outputs(),
+                   threshold);
+}
+
+template <typename T, size_t INP, size_t OUT, Linalg::Order ORDER>
+size_t topK(Layer::Dense<T, INP, OUT, ORDER> *layer, size_t k) {
+  T *w = layer->m_matrix.data();
+  if constexpr (ORDER == Linalg::Order::RowMajor)
+    return topK(w, INP, OUT, k);
+
+  size_t kept = 0;
+  for (size_t o = 0; o < OUT; o++)
+    kept += topK(w + o * (INP + 1), INP, 1, k);
+  return kept;
+}
+
+template <typename T> size_t topK(Layer::DynamicDense<T> *layer, size_t k) {
+  return topK(layer->m_matrix.data(), layer->inputs(), layer->outputs(), k);
+}
+
+} // namespace Prune
+
+namespace Activation {
+
+template <typename T, size_t IN>
+Linalg::Vector<T, IN> tanh(const Linalg::Vector<T, IN> &vec) {
+  Linalg::Vector<T, IN> result;
+  Simd::tanh(vec.data(), result.data(), IN);
+  return result;
+}
+
+template <typename T, size_t IN>
+Linalg::Vector<T, IN> relu(const Linalg::Vector<T, IN> &vec) {
+  Linalg::Vector<T, IN> result;
+  Simd::relu(vec.data(), result.data(), IN);
+  return result;
+}
+
+template <typename T, size_t IN>
+Linalg::Vector<T, IN> fastSigmoid(const Linalg::Vector<T, IN> &vec) {
+  Linalg::Vector<T, IN> result;
+  Simd::fastSigmoid(vec.data(), result.data(), IN);
+  return result;
+}
+
+template <typename T, size_t IN>
+Linalg::Vector<T, IN> softmax(const Linalg::Vector<T, IN> &vec) {
+  Linalg::Vector<T, IN> result;
+  Simd::softmax(vec.data(), result.data(), IN);
+  return result;
+}
+
+template <typename T> Linalg::Tensor<T> tanh(const Linalg::Tensor<T> &t) {
+  auto result = Linalg::Tensor<T>::like(t);
+  Simd::tanh(t.data(), result.data(), t.size());
+  return result;
+}
+
+template <typename T> Linalg::Tensor<T> relu(const Linalg::Tensor<T> &t) {
+  auto result = Linalg::Tensor<T>::like(t);
+  Simd::relu(t.data(), result.data(), t.size());
+  return result;
+}
+
+template <typename T>
+Linalg::Tensor<T> fastSigmoid(const Linalg::Tensor<T> &t) {
+  auto result = Linalg::Tensor<T>::like(t);
+  Simd::fastSigmoid(t.data(), result.data(), t.size());
+  return result;
+}
+
+// Softmax over the last dimension, so a batch is normalised per sample.
+template <typename T> Linalg::Tensor<T> softmax(const Linalg::Tensor<T> &t) {
+  auto result = Linalg::Tensor<T>::like(t);
+  const size_t cols = t.shape(t.rank() - 1);
+  for (size_t i = 0; i < t.size(); i += cols)
+    Simd::softmax(t.data() + i, result.data() + i, cols);
+  return result;
+}
+
+// Activations selected at runtime, e.g. from a model config.
+enum class Kind { Linear, Tanh, Relu, FastSigmoid, Softmax };
+
+inline const char *name(Kind kind) {
+  switch (kind) {
+  case Kind::Linear:
+    return "linear";
+  case Kind::Tanh:
+    return "tanh";
+  case Kind::Relu:
+    return "relu";
+  case Kind::FastSigmoid:
+    return "fastsigmoid";
+  case Kind::Softmax:
+    return "softmax";
+  }
+
+  return "unknown";
+}
+
+inline Container::Option<Kind> parse(const char *str) {
+  const Kind kinds[] = {Kind::Linear, Kind::Tanh, Kind::Relu,
+                        Kind::FastSigmoid, Kind::Softmax};
+
+  for (Kind kind : kinds)
+    if (strcmp(str, name(kind)) == 0)
+      return Container::Option<Kind>(kind);
+
+  return Container::Option<Kind>();
+}
+
+// Applies kind in place to n values laid out as rows of cols.
+template <typename T> void apply(Kind kind, T *x, size_t n, size_t cols) {
+  switch (kind) {
+  case Kind::Linear:
+    break;
+  case Kind::Tanh:
+    Simd::tanh(x, x, n);
+    break;
+  case Kind::Relu:
+    Simd::relu(x, x, n);
+    break;
+  case Kind::FastSigmoid:
+    Simd::fastSigmoid(x, x, n);
+    break;
+  case Kind::Softmax:
+    for (size_t i = 0; i < n; i += cols)
+      Simd::softmax(x + i, x + i, cols);
+    break;
+  }
+}
+
+template <typename T> Linalg::Tensor<T> apply(Kind kind, Linalg::Tensor<T> t) {
+  apply(kind, t.data(), t.size(), t.shape(t.rank() - 1));
+  return t;
+}
+
+} // namespace Activation
+
+namespace Loss {
+
+// Losses over raw network outputs. Each takes a single sample or a batch of
+// shape {batch, outputs} and returns the mean over the batch. Sums are kept in
+// double, so long batches of float outputs do not lose small terms, and the
+// result can be handed straight to Mutation::costMutate as the cost.
+
+// log(sum(exp(x))), shifted by the maximum so it cannot overflow.
+template <typename T> double logSumExp(const T *x, size_t n) {
+  using P = Simd::Pack<T>;
+  const size_t body = n - n % P::width;
+  const T max = Simd::maximum(x, n);
+  const P pmax = P::set1(max);
+
+  double sum = 0;
+  for (size_t i = 0; i < body; i += P::width)
+    sum += reduceAdd(Simd::exp(P::load(x + i) - pmax));
+  for (size_t i = body; i < n; i++)
+    sum += std::exp(x[i] - max);
+
+  return max + std::log(sum);
+}
+
+// -log(softmax(logits)[label]), without forming the softmax.
+template <typename T>
+double crossEntropy(const T *logits, size_t n, size_t label) {
+  ASSERT(label < n);
+  return logSumExp(logits, n) - logits[label];
+}
+
+// -sum(target * log(softmax(logits))) for a distribution or one-hot target.
+template <typename T>
+double crossEntropy(const T *logits, const T *target, size_t n) {
+  using P = Simd::Pack<T>;
+  const size_t body = n - n % P::width;
+
+  double mass = 0;
+  double dot = 0;
+  for (size_t i = 0; i < body; i += P::width) {
+    const P t = P::load(target + i);
+    mass += reduceAdd(t);
+    dot += reduceAdd(t * P::load(logits + i));
+  }
+  for (size_t i = body; i < n; i++) {
+    mass += target[i];
+    dot += static_cast<double>(target[i]) * logits[i];
+  }
+
+  return mass * logSumExp(logits, n) - dot;
+}
+
+// d crossEntropy / d logits = softmax(logits) - onehot(label).
+template <typename T>
+void crossEntropyGradient(const T *logits, size_t n, size_t label, T *grad) {
+  ASSERT(label < n);
+  Simd::softmax(logits, grad, n);
+  grad[label] -= 1;
+}
+
+template <typename T> double mse(const T *a, const T *b, size_t n) {
+  using P = Simd::Pack<T>;
+  const size_t body = n - n % P::width;
+
+  double sum = 0;
+  for (size_t i = 0; i < body; i += P::width) {
+    const P d = P::load(a + i) - P::load(b + i);
+    sum += reduceAdd(d * d);
+  }
+  for (size_t i = body; i < n; i++) {
+    const double d = static_cast<double>(a[i]) - b[i];
+    sum += d * d;
+  }
+
+  return n == 0 ? 0 : sum / n;
+}
+
+// d mse / d a.
+template <typename T>
+void mseGradient(const T *a, const T *b, size_t n, T *grad) {
+  const T scale = T(2) / n;
+  for (size_t i = 0; i < n; i++)
+    grad[i] = scale * (a[i] - b[i]);
+}
+
+// The index of the first largest element.
+template <typename T> size_t argmax(const T *x, size_t n) {
+  size_t best = 0;
+  for (size_t i = 1; i < n; i++)
+    best = x[i] > x[best] ? i : best;
+  return best;
+}
+
+template <typename T, size_t SIZE>
+double crossEntropy(const Linalg::Vector<T, SIZE> &logits, size_t label) {
+  return crossEntropy(logits.data(), SIZE, label);
+}
+
+template <typename T, size_t SIZE>
+double crossEntropy(const Linalg::Vector<T, SIZE> &logits,
+                    const Linalg::Vector<T, SIZE> &target) {
+  return crossEntropy(logits.data(), target.data(), SIZE);
+}
+
+template <typename T, size_t SIZE>
+double mse(const Linalg::Vector<T, SIZE> &a, const Linalg::Vector<T, SIZE> &b) {
+  return mse(a.data(), b.data(), SIZE);
+}
+
+template <typename T, size_t SIZE>
+size_t argmax(const Linalg::Vector<T, SIZE> &x) {
+  return argmax(x.data(), SIZE);
+}
+
+// Batches. A rank 1 tensor is a batch of one; labels holds one class index
+// per row.
+template <typename T> size_t batchSize(const Linalg::Tensor<T> &t) {
+  ASSERT(t.rank() == 1 || t.rank() == 2);
+  return t.rank() == 1 ? 1 : t.shape(0);
+}
+
+template <typename T> size_t sampleSize(const Linalg::Tensor<T> &t) {
+  return t.shape(t.rank() - 1);
+}
+
+// Rows narrower than a SIMD register would leave exp() scalar, so the whole
+// batch is shifted by its row maxima into one buffer and exponentiated in a
+// single pass.
+template <typename T>
+double crossEntropy(const Linalg::Tensor<T> &logits, const size_t *labels) {
+  const size_t n = sampleSize(logits);
+  const size_t batch = batchSize(logits);
+
+  if (n >= Simd::Pack<T>::width) {
+    double sum = 0;
+    for (size_t r = 0; r < batch; r++)
+      sum += crossEntropy(logits.data() + r * n, n, labels[r]);
+    return sum / batch;
+  }
+
+  Linalg::Tensor<T> shifted = Linalg::Tensor<T>::like(logits);
+  double sum = 0;
+  for (size_t r = 0; r < batch; r++) {
+    const T *x = logits.data() + r * n;
+    T *y = shifted.data() + r * n;
+    const T max = Simd::maximum(x, n);
+    for (size_t i = 0; i < n; i++)
+      y[i] = x[i] - max;
+    ASSERT(labels[r] < n);
+    sum -= y[labels[r]];
+  }
+
+  // Every row total lies in [1, n], so the product of 64 of them stays far
+  // inside double range and one log covers them all.
+  Simd::exp(shifted.data(), shifted.data(), shifted.size());
+  double product = 1;
+  for (size_t r = 0; r < batch; r++) {
+    const T *y = shifted.data() + r * n;
+    double total = 0;
+    for (size_t i = 0; i < n; i++)
+      total += y[i];
+    product *= total;
+
+    if (r % 64 == 63) {
+      sum += std::log(product);
+      product = 1;
+    }
+  }
+
+  return (sum + std::log(product)) / batch;
+}
+
+template <typename T>
+double crossEntropy(const Linalg::Tensor<T> &logits,
+                    const Linalg::Tensor<T> &targets) {
+  ASSERT(logits.sameShape(targets));
+  const size_t n = sampleSize(logits);
+  double sum = 0;
+  for (size_t r = 0; r < batchSize(logits); r++)
+    sum += crossEntropy(logits.data() + r * n, targets.data() + r * n, n);
+  return sum / batchSize(logits);
+}
+
+// The gradient of the batch mean, one row per sample.
+template <typename T>
+Linalg::Tensor<T> crossEntropyGradient(const Linalg::Tensor<T> &logits,
+                                       const size_t *labels) {
+  const size_t n = sampleSize(logits);
+  const T weight = T(1) / batchSize(logits);
+  Linalg::Tensor<T> grad = Linalg::Tensor<T>::like(logits);
+
+  for (size_t r = 0; r < batchSize(logits); r++) {
+    T *g = grad.data() + r * n;
+    crossEntropyGradient(logits.data() + r * n, n, labels[r], g);
+    Simd::scale(g, n, weight);
+  }
+  return grad;
+}
+
+// Mean over every element, which for a batch is the mean of the per-sample
+// means.
+template <typename T>
+double mse(const Linalg::Tensor<T> &a, const Linalg::Tensor<T> &b) {
+  ASSERT(a.sameShape(b));
+  return mse(a.data(), b.data(), a.size());
+}
+
+template <typename T>
+Linalg::Tensor<T> mseGradient(const Linalg::Tensor<T> &a,
+                              const Linalg::Tensor<T> &b) {
+  ASSERT(a.sameShape(b));
+  Linalg::Tensor<T> grad = Linalg::Tensor<T>::like(a);
+  mseGradient(a.data(), b.data(), a.size(), grad.data());
+  return grad;
+}
+
+// The fraction of rows whose largest output is the label.
+template <typename T>
+double accuracy(const Linalg::Tensor<T> &outputs, const size_t *labels) {
+  const size_t n = sampleSize(outputs);
+  size_t correct = 0;
+  for (size_t r = 0; r < batchSize(outputs); r++)
+    correct += argmax(outputs.data() + r * n, n) == labels[r];
+  return static_cast<double>(correct) / batchSize(outputs);
+}
+
+// The same against one-hot or distribution targets.
+template <typename T>
+double accuracy(const Linalg::Tensor<T> &outputs,
+                const Linalg::Tensor<T> &targets) {
+  ASSERT(outputs.sameShape(targets));
+  const size_t n = sampleSize(outputs);
+  size_t correct = 0;
+  for (size_t r = 0; r < batchSize(outputs); r++)
+    correct += argmax(outputs.data() + r * n, n) ==
+               argmax(targets.data() + r * n, n);
+  return static_cast<double>(correct) / batchSize(outputs);
+}
+
+} // namespace Loss
+
+namespace Mutation {
+
+// Every mutation draws from NNKek::gen, so seeding it makes a run repeatable
+// and saving it in a Checkpoint makes a resumed run match an unbroken one.
+//
+// The pointer versions work on any flat run of parameters, such as a whole
+// Model::Genome; the others apply them to the storage of one layer.
+
+// The return type of the pointer versions. They only take arrays of floating
+// point values, so a layer overload called with a double rate is never
+// ambiguous with them.
+template <typename T>
+using Flat = typename std::enable_if<std::is_floating_point<T>::value>::type;
+
+// Calls f(i) for every index in [0, n) picked with probability rate. Jumps
+// straight from one picked index to the next, so a low rate over a large
+// genome costs a few draws instead of one per parameter.
+template <typename F> void forSample(size_t n, float rate, F f) {
+  if (rate <= 0) {
+    return;
+  }
+
+  if (rate >= 1) {
+    for (size_t i = 0; i < n; i++) {
+      f(i);
+    }
+    return;
+  }
+
+  std::geometric_distribution<size_t> skip(rate);
+  for (size_t i = skip(gen); i < n; i += 1 + skip(gen)) {
+    f(i);
+  }
+}
+
+template <typename T>
+Flat<T> testMutate(T *params, size_t n, float rate = 0.5) {
+  std::uniform_real_distribution<> dis(-10, 10);
+  forSample(n, rate, [&](size_t i) { params[i] = dis(gen); });
+}
+
+template <typename T> Flat<T> normalMutate(T *params, size_t n, float stddev) {
+  std::normal_distribution<> normal(0, stddev);
+
+  for (size_t i = 0; i < n; i++) {
+    params[i] += normal(gen);
+  }
+}
+
+template <typename T>
+Flat<T> normalMutate(T *params, size_t n, float rate, float stddev) {
+  std::normal_distribution<> normal(0, stddev);
+  forSample(n, rate, [&](size_t i) { params[i] += normal(gen); });
+}
+
+// Acceptance counts of a mutation operator, to watch how fast a run is
+// converging.
+struct Stats {
+  size_t trials = 0;
+  size_t successes = 0;
+
+  void record(bool success) {
+    trials++;
+    successes += success;
+  }
+
+  size_t failures() const { return trials - successes; }
+
+  double rate() const {
+    return trials == 0 ? 0 : static_cast<double>(successes) / trials;
+  }
+};
+
+// A step size that follows Rechenberg's 1/5th success rule. After every window
+// trials it grows by 1 / factor if more than a fifth of them succeeded and
+// shrinks by factor if fewer did, staying within [minimum, maximum].
+//
+// costMutate reports to it by itself. Population loops pass sigma() to
+// normalMutate and report whether each child replaced its parent.
+template <typename T> class Adaptive {
+public:
+  explicit Adaptive(T sigma, size_t window = 10, T factor = 0.82,
+                    T minimum = 1e-9, T maximum = 1e3)
+      : m_sigma(sigma), m_window(window), m_factor(factor),
+        m_minimum(minimum), m_maximum(maximum) {
+    ASSERT(window > 0);
+    ASSERT(factor > 0 && factor < 1);
+  }
+
+  T sigma() const { return m_sigma; }
+
+  void report(bool success) {
+    m_total.record(success);
+    m_current.record(success);
+
+    if (m_current.trials < m_window) {
+      return;
+    }
+
+    m_recent = m_current.rate();
+    m_current = Stats();
+
+    if (m_recent > 0.2) {
+      m_sigma = Util::min(m_sigma / m_factor, m_maximum);
+    } else if (m_recent < 0.2) {
+      m_sigma = Util::max(m_sigma * m_factor, m_minimum);
+    }
+  }
+
+  // Counts since construction.
+  const Stats &stats() const { return m_total; }
+
+  // Success rate of the last complete window.
+  double recentRate() const { return m_recent; }
+
+private:
+  T m_sigma;
+  size_t m_window;
+  T m_factor;
+  T m_minimum;
+  T m_maximum;
+  Stats m_total;
+  Stats m_current;
+  double m_recent = 0;
+};
+
+// Nudges one random parameter, given cost = f() of the current parameters,
+// and puts it back if f() got worse. Returns f() of the nudged parameters.
+template <typename T, typename F, typename C>
+C costTrial(T *params, size_t n, F f, T stddev, C cost) {
+  ASSERT(n > 0);
+  std::uniform_int_distribution<size_t> index(0, n - 1);
+  std::normal_distribution<> normalDist{0, stddev};
+  size_t i = index(gen);
+  T diff = normalDist(gen);
+
+  const T old = params[i];
+  params[i] += diff;
+  const C costPos = f();
+
+  if (costPos > cost) {
+    params[i] = old;
+  }
+
+  return costPos;
+}
+
+// Nudges one random parameter and keeps the change only if f() does not get
+// worse. Returns by how much it changed f(), positive if it was undone.
+template <typename T, typename F>
+auto costStep(T *params, size_t n, F f, T stddev) {
+  auto cost = f();
+  return costTrial(params, n, f, stddev, cost) - cost;
+}
+
+template <typename T, typename F>
+Flat<T> costMutate(T *params, size_t n, F f, T stddev) {
+  costStep(params, n, f, stddev);
+}
+
+// The same with a step size that adapts to how many nudges improve f(). Nudges
+// that change nothing, such as ones into a saturated unit, say nothing about
+// the step size and are not reported.
+template <typename T, typename F>
+Flat<T> costMutate(T *params, size_t n, F f, Adaptive<T> *step) {
+  const auto change = costStep(params, n, f, step->sigma());
+
+  if (change != 0) {
+    step->report(change < 0);
+  }
+}
+
+// costMutate for loops that keep the cost of their parameters: cost must be
+// f() of the parameters as they are, and the cost of the parameters as they
+// are left is returned. Chained steps then evaluate f() once each instead of
+// twice, see Train::Loop.
+template <typename T, typename F, typename C>
+C costMutate(T *params, size_t n, F f, T stddev, C cost) {
+  return Util::min(costTrial(params, n, f, stddev, cost), cost);
+}
+
+template <typename T, typename F, typename C>
+C costMutate(T *params, size_t n, F f, Adaptive<T> *step, C cost) {
+  const C costPos = costTrial(params, n, f, step->sigma(), cost);
+
+  if (costPos != cost) {
+    step->report(costPos < cost);
+  }
+
+  return Util::min(costPos, cost);
+}
+
+// Log-normal self-adaptation: every parameter carries its own step size in
+// sigmas, which is mutated first and then moves the parameter. Step sizes
+// that produce surviving children survive with them, as long as they are kept
+// next to the parameters, e.g. in the second half of each population row.
+template <typename T>
+Flat<T> selfAdaptMutate(T *params, T *sigmas, size_t n, T minimum = 1e-9) {
+  const double tau = 1 / std::sqrt(2 * std::sqrt(static_cast<double>(n)));
+  const double tauGlobal = 1 / std::sqrt(2.0 * n);
+  std::normal_distribution<> normal(0, 1);
+  const double global = tauGlobal * normal(gen);
+
+  for (size_t i = 0; i < n; i++) {
+    const T sigma = sigmas[i] * std::exp(global + tau * normal(gen));
+    sigmas[i] = Util::max(sigma, minimum);
+    params[i] += sigmas[i] * normal(gen);
+  }
+}
+
+// The same with one step size for all n parameters, such as one per layer.
+template <typename T>
+Flat<T> selfAdaptMutate(T *params, size_t n, T *sigma, T minimum = 1e-9) {
+  const double tau = 1 / std::sqrt(static_cast<double>(n));
+  std::normal_distribution<> normal(0, 1);
+  const T scaled = *sigma * std::exp(tau * normal(gen));
+  *sigma = Util::max(scaled, minimum);
+
+  for (size_t i = 0; i < n; i++) {
+    params[i] += *sigma * normal(gen);
+  }
+}
+
+// Uniform crossover: each child parameter comes from a or b with equal odds.
+// One draw of gen supplies 32 choices.
+template <typename T>
+Flat<T> crossover(const T *a, const T *b, T *child, size_t n) {
+  for (size_t i = 0; i < n; i += 32) {
+    const uint32_t bits = static_cast<uint32_t>(gen());
+    const size_t end = Util::min(n, i + 32);
+
+    for (size_t j = i; j < end; j++) {
+      child[j] = (bits >> (j - i)) & 1 ? b[j] : a[j];
+    }
+  }
+}
+
+// Blend crossover, child = a + alpha * (b - a), vectorized over the genome.
+template <typename T>
+Flat<T> blend(const T *a, const T *b, T *child, size_t n, T alpha) {
+  using P = Simd::Pack<T>;
+  const size_t body = n - n % P::width;
+  const P pa = P::set1(alpha);
+
+  for (size_t i = 0; i < body; i += P::width) {
+    const P x = P::load(a + i);
+    fmadd(pa, P::load(b + i) - x, x).store(child + i);
+  }
+  for (size_t i = body; i < n; i++) {
+    child[i] = a[i] + alpha * (b[i] - a[i]);
+  }
+}
+
+// f() for the container overloads of costMutate, which write through a kept
+// pointer between evaluations; see Linalg::Storage::modified.
+template <typename C, typename F> auto tracked(C *container, F &f) {
+  return [container, &f]() {
+    container->modified();
+    return f();
+  };
+}
+
+// The operators only see the flat values, so they work the same for either
+// storage order. They mark the values modified, and costMutate also does so
+// before every f(), so a Model::PrefixCache inside f() sees each nudge.
+template <typename T, size_t ROWS, size_t COLS, Linalg::Order ORDER>
+void testMutate(Linalg::Matrix<T, ROWS, COLS, ORDER> *matrix,
+                float rate = 0.5) {
+  testMutate(matrix->data(), ROWS * COLS, rate);
+  matrix->modified();
+}
+
+template <typename T, size_t ROWS, size_t COLS, Linalg::Order ORDER>
+void normalMutate(Linalg::Matrix<T, ROWS, COLS, ORDER> *matrix,
+                  float stddev) {
+  normalMutate(matrix->data(), ROWS * COLS, stddev);
+  matrix->modified();
+}
+
+template <typename T, size_t ROWS, size_t COLS, Linalg::Order ORDER>
+void normalMutate(Linalg::Matrix<T, ROWS, COLS, ORDER> *matrix, float rate,
+                  float stddev) {
+  normalMutate(matrix->data(), ROWS * COLS, rate, stddev);
+  matrix->modified();
+}
+
+template <typename T, typename F, size_t ROWS, size_t COLS,
+          Linalg::Order ORDER>
+void costMutate(Linalg::Matrix<T, ROWS, COLS, ORDER> *matrix, F f,
+                T stddev) {
+  costMutate(matrix->data(), ROWS * COLS, tracked(matrix, f), stddev);
+  matrix->modified();
+}
+
+template <typename T, typename F, size_t ROWS, size_t COLS,
+          Linalg::Order ORDER>
+void costMutate(Linalg::Matrix<T, ROWS, COLS, ORDER> *matrix, F f,
+                Adaptive<T> *step) {
+  costMutate(matrix->data(), ROWS * COLS, tracked(matrix, f), step);
+  matrix->modified();
+}
+
+template <typename T, typename F, typename C, size_t ROWS, size_t COLS,
+          Linalg::Order ORDER>
+C costMutate(Linalg::Matrix<T, ROWS, COLS, ORDER> *matrix, F f, T stddev,
+             C cost) {
+  const C next =
+      costMutate(matrix->data(), ROWS * COLS, tracked(matrix, f), stddev, cost);
+  matrix->modified();
+  return next;
+}
+
+template <typename T, typename F, typename C, size_t ROWS, size_t COLS,
+          Linalg::Order ORDER>
+C costMutate(Linalg::Matrix<T, ROWS, COLS, ORDER> *matrix, F f,
+             Adaptive<T> *step, C cost) {
+  const C next =
+      costMutate(matrix->data(), ROWS * COLS, tracked(matrix, f), step, cost);
+  matrix->modified();
+  return next;
+}
+
+template <typename T, size_t ROWS, size_t COLS, Linalg::Order ORDER>
+void selfAdaptMutate(Linalg::Matrix<T, ROWS, COLS, ORDER> *matrix, T *sigma) {
+  selfAdaptMutate(matrix->data(), ROWS * COLS, sigma);
+  matrix->modified();
+}
+
+template <typename T>
+void testMutate(Linalg::Tensor<T> *tensor, float rate = 0.5) {
+  testMutate(tensor->data(), tensor->size(), rate);
+  tensor->modified();
+}
+
+template <typename T>
+void normalMutate(Linalg::Tensor<T> *tensor, float stddev) {
+  normalMutate(tensor->data(), tensor->size(), stddev);
+  tensor->modified();
+}
+
+template <typename T>
+void normalMutate(Linalg::Tensor<T> *tensor, float rate, float stddev) {
+  normalMutate(tensor->data(), tensor->size(), rate, stddev);
+  tensor->modified();
+}
+
+template <typename T, typename F>
+void costMutate(Linalg::Tensor<T> *tensor, F f, T stddev) {
+  costMutate(tensor->data(), tensor->size(), tracked(tensor, f), stddev);
+  tensor->modified();
+}
+
+template <typename T, typename F>
+void costMutate(Linalg::Tensor<T> *tensor, F f, Adaptive<T> *step) {
+  costMutate(tensor->data(), tensor->size(), tracked(tensor, f), step);
+  tensor->modified();
+}
+
+template <typename T, typename F, typename C>
+C costMutate(Linalg::Tensor<T> *tensor, F f, T stddev, C cost) {
+  const C next = costMutate(tensor->data(), tensor->size(),
+                            tracked(tensor, f), stddev, cost);
+  tensor->modified();
+  return next;
+}
+
+template <typename T, typename F, typename C>
+C costMutate(Linalg::Tensor<T> *tensor, F f, Adaptive<T> *step, C cost) {
+  const C next = costMutate(tensor->data(), tensor->size(),
+                            tracked(tensor, f), step, cost);
+  tensor->modified();
+  return next;
+}
+
+template <typename T>
+void selfAdaptMutate(Linalg::Tensor<T> *tensor, T *sigma) {
+  selfAdaptMutate(tensor->data(), tensor->size(), sigma);
+  tensor->modified();
+}
+
+template <typename T>
+void testMutate(Layer::SparseDense<T> *layer, float rate = 0.5) {
+  auto &params = layer->parameters();
+  testMutate(params.data(), params.size(), rate);
+}
+
+template <typename T>
+void normalMutate(Layer::SparseDense<T> *layer, float stddev) {
+  auto &params = layer->parameters();
+  normalMutate(params.data(), params.size(), stddev);
+}
+
+template <typename T>
+void normalMutate(Layer::SparseDense<T> *layer, float rate, float stddev) {
+  auto &params = layer->parameters();
+  normalMutate(params.data(), params.size(), rate, stddev);
+}
+
+template <typename T, typename F>
+void costMutate(Layer::SparseDense<T> *layer, F f, T stddev) {
+  auto &params = layer->parameters();
+  costMutate(params.data(), params.size(), f, stddev);
+}
+
+template <typename T, typename F>
+void costMutate(Layer::SparseDense<T> *layer, F f, Adaptive<T> *step) {
+  auto &params = layer->parameters();
+  costMutate(params.data(), params.size(), f, step);
+}
+
+template <typename T, typename F, typename C>
+C costMutate(Layer::SparseDense<T> *layer, F f, T stddev, C cost) {
+  auto &params = layer->parameters();
+  return costMutate(params.data(), params.size(), f, stddev, cost);
+}
+
+template <typename T, typename F, typename C>
+C costMutate(Layer::SparseDense<T> *layer, F f, Adaptive<T> *step, C cost) {
+  auto &params = layer->parameters();
+  return costMutate(params.data(), params.size(), f, step, cost);
+}
+
+template <typename T>
+void selfAdaptMutate(Layer::SparseDense<T> *layer, T *sigma) {
+  auto &params = layer->parameters();
+  selfAdaptMutate(params.data(), params.size(), sigma);
+}
+
+} // namespace Mutation
+
+namespace Model {
+
+// A stack of DynamicDense layers, each followed by an activation. The shape
+// lives in data, so it can be built at runtime or read from a config file:
+//
+//   # comment
+//   input 4
+//   dense 8 relu
+//   dense 3 softmax
+template <typename T> class Network {
+public:
+  size_t inputs() const { return m_inputs; }
+
+  size_t outputs() const {
+    return depth() == 0 ? m_inputs : m_layers[depth() - 1].outputs();
+  }
+
+  size_t depth() const { return m_layers.size(); }
+
+  void setInputs(size_t inputs) {
+    ASSERT(depth() == 0);
+    m_inputs = inputs;
+  }
+
+  void add(size_t outputs, Activation::Kind activation) {
+    m_layers.push(Layer::DynamicDense<T>(this->outputs(), outputs));
+    m_activations.push(activation);
+  }
+
+  Layer::DynamicDense<T> &layer(size_t i) { return m_layers[i]; }
+
+  const Layer::DynamicDense<T> &layer(size_t i) const { return m_layers[i]; }
+
+  Activation::Kind activation(size_t i) const { return m_activations[i]; }
+
+  size_t parameters() const {
+    size_t n = 0;
+    for (size_t l = 0; l < depth(); l++)
+      n += m_layers[l].m_matrix.size();
+    return n;
+  }
+
+  // Batches big enough to be worth it are split into chunks of rows that go
+  // through all the layers at once, on Parallel::Pool::global(). Rows never
+  // interact, so the result is the same for any number of threads.
+  Linalg::Tensor<T> forward(const Linalg::Tensor<T> &input) const {
+    ASSERT(depth() > 0);
+
+    const size_t batch = input.rank() == 2 ? input.shape(0) : 1;
+    const size_t work = Util::max<size_t>(parameters(), 1);
+    const size_t grain = Util::max<size_t>(parallelWork / work, 16);
+    if (batch >= 2 * grain) {
+      ASSERT(input.shape(1) == m_inputs);
+      Linalg::Tensor<T> result(batch, outputs());
+      const T *in = input.data();
+      T *out = result.data();
+      Parallel::parallelFor(batch, grain, [&](size_t begin, size_t end) {
+        forwardRows(in + begin * m_inputs, out + begin * outputs(),
+                    end - begin);
+      });
+      return result;
+    }
+
+    auto result = Activation::apply(m_activations[0], m_layers[0].forward(input));
+    for (size_t i = 1; i < depth(); i++)
+      result =
+          Activation::apply(m_activations[i], m_layers[i].forward(result));
+
+    return result;
+  }
+
+  static Container::Option<Network> fromConfig(const char *path) {
+    Network net;
+    bool ok = true;
+    size_t lineNo = 0;
+
+    bool found = Fs::readLines(path, [&](Container::String line) {
+      lineNo++;
+      char word[64];
+      if (!ok || sscanf(line.c_str(), "%63s", word) != 1 || word[0] == '#')
+        return;
+
+      char count[64];
+      char act[64] = "linear";
+      const bool counted =
+          sscanf(line.c_str(), "%*s %63s %63s", count, act) >= 1;
+
+      // %zu would take "-1" for SIZE_MAX, so the count must be all digits.
+      char *end = NULL;
+      const size_t n = counted && count[0] >= '0' && count[0] <= '9'
+                           ? strtoull(count, &end, 10)
+                           : 0;
+      const bool positive = n > 0 && *end == '\0';
+
+      if (strcmp(word, "input") == 0 && positive && net.depth() == 0) {
+        net.setInputs(n);
+      } else if (strcmp(word, "dense") == 0 && positive && net.inputs() > 0 &&
+                 Activation::parse(act).is_some()) {
+        net.add(n, Activation::parse(act).value());
+      } else {
+        fprintf(stderr, "%s:%zu: invalid line '%s'\n", path, lineNo,
+                line.c_str());
+        ok = false;
+      }
+    });
+
+    if (!found || !ok || net.depth() == 0)
+      return Container::Option<Network>();
+
+    return Container::Option<Network>(net);
+  }
+
+  // Binary model file. A layer whose non-zero weights take less space as
+  // (index, value) pairs than the full matrix, e.g. after Prune, is stored
+  // that way and expanded again on load.
+  bool save(const char *path) const {
+    Fs::Writer w(path);
+    w.writeArray(fileMagic, sizeof(fileMagic));
+    w.write(fileVersion);
+    w.write(static_cast<uint32_t>(sizeof(T)));
+    w.write(static_cast<uint64_t>(m_inputs));
+    w.write(static_cast<uint64_t>(depth()));
+
+    for (size_t l = 0; l < depth(); l++) {
+      const Linalg::Tensor<T> &m = m_layers[l].m_matrix;
+
+      uint64_t nnz = 0;
+      for (size_t i = 0; i < m.size(); i++)
+        nnz += m[i] != 0;
+      // The indices are stored as uint32_t, so larger layers stay dense.
+      const uint32_t sparse =
+          m.size() <= UINT32_MAX &&
+          nnz * (sizeof(uint32_t) + sizeof(T)) < m.size() * sizeof(T);
+
+      w.write(static_cast<uint64_t>(m_layers[l].outputs()));
+      w.write(static_cast<uint32_t>(m_activations[l]));
+      w.write(sparse);
+
+      if (!sparse) {
+        w.writeArray(m.data(), m.size());
+        continue;
+      }
+
+      w.write(nnz);
+      for (size_t i = 0; i < m.size(); i++)
+        if (m[i] != 0)
+          w.write(static_cast<uint32_t>(i));
+      for (size_t i = 0; i < m.size(); i++)
+        if (m[i] != 0)
+          w.write(m[i]);
+    }
+
+    return w.close();
+  }
+
+  static Container::Option<Network> load(const char *path) {
+    Fs::Reader r(path);
+    char magic[sizeof(fileMagic)];
+    uint32_t version = 0;
+    uint32_t size = 0;
+    uint64_t inputs = 0;
+    uint64_t depth = 0;
+
+    if (!r.readArray(magic, sizeof(magic)) || !r.read(&version) ||
+        !r.read(&size) || !r.read(&inputs) || !r.read(&depth) ||
+        memcmp(magic, fileMagic, sizeof(magic)) != 0 ||
+        version != fileVersion || size != sizeof(T) || inputs == 0 ||
+        inputs == SIZE_MAX)
+      return Container::Option<Network>();
+
+    // Every size comes from the file, so each is checked against what the
+    // file still holds before anything is allocated for it, and a layer
+    // that does not fit in memory fails the load.
+    constexpr size_t layerHeader = sizeof(uint64_t) + 2 * sizeof(uint32_t);
+    if (depth > r.remaining() / layerHeader)
+      return Container::Option<Network>();
+
+    Network net;
+    net.setInputs(inputs);
+
+    for (size_t l = 0; l < depth; l++) {
+      uint64_t outputs = 0;
+      uint32_t activation = 0;
+      uint32_t sparse = 0;
+      if (!r.read(&outputs) || !r.read(&activation) || !r.read(&sparse) ||
+          outputs == 0 || outputs == SIZE_MAX ||
+          activation > static_cast<uint32_t>(Activation::Kind::Softmax))
+        return Container::Option<Network>();
+
+      const size_t shape[] = {net.outputs() + 1, static_cast<size_t>(outputs)};
+      size_t weights = 0;
+      size_t bytes = 0;
+      uint64_t nnz = 0;
+      if (!Util::multiply(shape[0], shape[1], &weights))
+        return Container::Option<Network>();
+
+      if (!sparse) {
+        if (!Util::multiply(weights, sizeof(T), &bytes) ||
+            bytes > r.remaining())
+          return Container::Option<Network>();
+      } else if (weights > UINT32_MAX || !r.read(&nnz) || nnz > weights ||
+                 nnz > r.remaining() / (sizeof(uint32_t) + sizeof(T))) {
+        return Container::Option<Network>();
+      }
+
+      auto matrix = Linalg::Tensor<T>::tryWithShape(2, shape);
+      if (!matrix.is_some())
+        return Container::Option<Network>();
+
+      Layer::DynamicDense<T> layer;
+      layer.m_matrix = matrix.value();
+      net.m_layers.push(layer);
+      net.m_activations.push(static_cast<Activation::Kind>(activation));
+      Linalg::Tensor<T> &m = net.layer(l).m_matrix;
+
+      if (!sparse) {
+        if (!r.readArray(m.data(), m.size()))
+          return Container::Option<Network>();
+        continue;
+      }
+
+      Container::Vector<uint32_t> indices;
+      for (size_t k = 0; k < nnz; k++) {
+        uint32_t index = 0;
+        if (!r.read(&index) || index >= m.size())
+          return Container::Option<Network>();
+        indices.push(index);
+      }
+
+      for (size_t k = 0; k < nnz; k++)
+        if (!r.read(&m[indices[k]]))
+          return Container::Option<Network>();
+    }
+
+    return Container::Option<Network>(net);
+  }
+
+private:
+  static constexpr char fileMagic[8] = {'N', 'N', 'K', 'E', 'K', 'N', 'E', 'T'};
+  static constexpr uint32_t fileVersion = 1;
+
+  // Multiply-adds per parallel task; smaller batches run on the caller.
+  static constexpr size_t parallelWork = 1 << 16;
+
+  // Runs rows samples through every layer, keeping the intermediate outputs
+  // in the calling thread's scratch buffers.
+  void forwardRows(const T *in, T *out, size_t rows) const {
+    size_t width = 0;
+    for (size_t l = 0; l < depth(); l++)
+      width = Util::max(width, m_layers[l].outputs());
+
+    T *buffers[2] = {Parallel::scratch<T>(rows * width, 0),
+                     Parallel::scratch<T>(rows * width, 1)};
+
+    for (size_t l = 0; l < depth(); l++) {
+      const auto &layer = m_layers[l];
+      T *result = l + 1 == depth() ? out : buffers[l % 2];
+      Simd::affineBatch(in, layer.m_matrix.data(), result, rows,
+                        layer.inputs(), layer.outputs());
+      Activation::apply(m_activations[l], result, rows * layer.outputs(),
+                        layer.outputs());
+      in = result;
+    }
+  }
+
+  size_t m_inputs = 0;
+  Container::Vector<Layer::DynamicDense<T>> m_layers;
+  Container::Vector<Activation::Kind> m_activations;
+};
+
+// Forward passes over one fixed input batch that skip the layers a network
+// shares with the previous one evaluated. Layer storage is copy-on-write, so
+// a child that only mutated its last layer still holds its parent's earlier
+// layers, and their activations are taken from the cache.
+//
+// Layers are matched by Storage::stamp(). Code that writes weights through a
+// pointer kept across forward() calls must call modified() on the matrix,
+// as the Mutation overloads for Tensor do. Layers that are views, e.g. of a
+// Genome, are never reused, so Genome::load() and the pointer versions of
+// Mutation on a genome need nothing.
+template <typename T> class PrefixCache {
+public:
+  explicit PrefixCache(const Linalg::Tensor<T> &input) : m_input(input) {}
+
+  Linalg::Tensor<T> forward(const Network<T> &net) {
+    ASSERT(net.depth() > 0);
+
+    size_t reuse = 0;
+    while (reuse < net.depth() && reuse < m_stamps.size() &&
+           m_stamps[reuse] == key(net, reuse))
+      reuse++;
+
+    // Layers from the first mismatch on are recomputed and replace the
+    // cached ones.
+    while (m_stamps.size() > reuse) {
+      m_stamps.pop();
+      m_outputs.pop();
+    }
+
+    m_reused += reuse;
+    m_computed += net.depth() - reuse;
+
+    for (size_t l = reuse; l < net.depth(); l++) {
+      const Linalg::Tensor<T> &input = l == 0 ? m_input : m_outputs[l - 1];
+      m_outputs.push(Activation::apply(net.activation(l),
+                                       net.layer(l).forward(input)));
+      m_stamps.push(key(net, l));
+    }
+
+    return m_outputs[net.depth() - 1];
+  }
+
+  // Layer passes taken from the cache and run, over all calls.
+  size_t reused() const { return m_reused; }
+
+  size_t computed() const { return m_computed; }
+
+private:
+  // Folds the activation into the stamp, which alone only covers weights.
+  static uint64_t key(const Network<T> &net, size_t l) {
+    return net.layer(l).m_matrix.storage().stamp() * 8 +
+           static_cast<uint64_t>(net.activation(l));
+  }
+
+  Linalg::Tensor<T> m_input;
+  Container::Vector<uint64_t> m_stamps;
+  Container::Vector<Linalg::Tensor<T>> m_outputs;
+  size_t m_reused = 0;
+  size_t m_computed = 0;
+};
+
+// All parameters of a set of layers in one aligned buffer, with the layers
+// turned into views of it. The layers run as before, but a candidate is now
+// a single array: cloning it is one memcpy, the pointer versions of Mutation
+// cover every layer in one call, and a population is just a Tensor of shape
+// {count, size()} whose rows are loaded into the genome in turn.
+//
+//   Layer::Dense<float, 1, 50> layer1;
+//   Layer::Dense<float, 50, 1> layer2;
+//   Model::Genome<float> genome(&layer1, &layer2);
+//   Mutation::normalMutate(genome.data(), genome.size(), 0.1f, 0.05f);
+//
+// The current weights of the layers are kept, but the layers become views of
+// the genome's buffer, so the two must go together: the layers must not be
+// used once the genome is gone, and the genome must not outlive the layers it
+// views.
+template <typename T> class Genome {
+public:
+  static constexpr size_t alignment = 64;
+
+  template <typename... Layers> explicit Genome(Layers *...layers) {
+    allocate((count(layers) + ... + 0));
+    size_t offset = 0;
+    (bind(layers, &offset), ...);
+  }
+
+  explicit Genome(Network<T> *net) {
+    size_t size = 0;
+    for (size_t l = 0; l < net->depth(); l++)
+      size += count(&net->layer(l));
+
+    allocate(size);
+    size_t offset = 0;
+    for (size_t l = 0; l < net->depth(); l++)
+      bind(&net->layer(l), &offset);
+  }
+
+  Genome(const Genome &) = delete;
+  Genome &operator=(const Genome &) = delete;
+
+  ~Genome() { free(m_values); }
+
+  size_t size() const { return m_size; }
+
+  T *data() { return m_values; }
+
+  const T *data() const { return m_values; }
+
+  // Makes params, size() values such as a population row, the current
+  // weights of the layers.
+  void load(const T *params) {
+    memcpy(m_values, params, m_size * sizeof(T));
+  }
+
+  void store(T *params) const {
+    memcpy(params, m_values, m_size * sizeof(T));
+  }
+
+private:
+  template <size_t INP, size_t OUT, Linalg::Order ORDER>
+  static size_t count(const Layer::Dense<T, INP, OUT, ORDER> *) {
+    return (INP + 1) * OUT;
+  }
+
+  static size_t count(const Layer::DynamicDense<T> *layer) {
+    return layer->m_matrix.size();
+  }
+
+  template <size_t INP, size_t OUT, Linalg::Order ORDER>
+  void bind(Layer::Dense<T, INP, OUT, ORDER> *layer, size_t *offset) {
+    T *values = m_values + *offset;
+    memcpy(values, layer->m_matrix.data(), count(layer) * sizeof(T));
+    layer->m_matrix.view(values);
+    *offset += count(layer);
+  }
+
+  void bind(Layer::DynamicDense<T> *layer, size_t *offset) {
+    T *values = m_values + *offset;
+    memcpy(values, layer->m_matrix.data(), count(layer) * sizeof(T));
+    layer->m_matrix.view(values);
+    *offset += count(layer);
+  }
+
+  void allocate(size_t size) {
+    size_t bytes = (size * sizeof(T) + alignment - 1) / alignment * alignment;
+    bytes = bytes == 0 ? alignment : bytes;
+    m_values = static_cast<T *>(aligned_alloc(alignment, bytes));
+    ASSERT(m_values != NULL);
+    m_size = size;
+  }
+
+  T *m_values;
+  size_t m_size;
+};
+
+} // namespace Model
+
+namespace Train {
+
+struct Config {
+  // Stop once the training cost is at or below this.
+  double targetCost = 0;
+  // Stop after this many iterations or seconds, 0 for no limit.
+  size_t maxIterations = 0;
+  double maxSeconds = 0;
+  // Run the held-out evaluation every this many iterations, 0 for only once
+  // the run is over.
+  size_t evaluateEvery = 0;
+  // Stop once this many held-out evaluations in a row have not improved on
+  // the best one, 0 to never stop early.
+  size_t patience = 0;
+  // Prints the costs at every held-out evaluation.
+  bool verbose = false;
+};
+
+struct Stats {
+  size_t iterations = 0;
+  // Evaluations of the training cost, held-out ones not included.
+  size_t evaluations = 0;
+  size_t heldOutEvaluations = 0;
+  double cost = 0;
+  double heldOutCost = 0;
+  double bestHeldOutCost = std::numeric_limits<double>::max();
+  double seconds = 0;
+};
+
+// Hill climbing with Mutation::costMutate over a few blocks of parameters,
+// usually the weights of each layer. Every iteration nudges every block once.
+// The cost of the incumbent is kept from step to step, so an iteration costs
+// one evaluation of f() per block instead of two per block plus one for the
+// stopping test. Stopping criteria only look at the kept cost; the held-out
+// cost is computed every evaluateEvery iterations.
+//
+//   auto loop = Train::loop<float>(cost, config);
+//   loop.add(&layer1.m_matrix, 0.1f);
+//   loop.add(&layer2.m_matrix, &step2);
+//   loop.run(heldOutCost);
+//
+// Blocks are nudged in the order they were added. If the parameters change
+// behind the loop's back, invalidate() makes it evaluate f() afresh.
+template <typename T, typename F> class Loop {
+public:
+  Loop(F f, const Config &config) : m_f(f), m_config(config) {}
+
+  void add(T *params, size_t n, T stddev) {
+    push(params, values, n, stddev, NULL);
+  }
+
+  void add(T *params, size_t n, Mutation::Adaptive<T> *step) {
+    push(params, values, n, 0, step);
+  }
+
+  // The same for the values of a matrix, a tensor or a sparse layer. step is
+  // a standard deviation or an Adaptive step size.
+  template <size_t ROWS, size_t COLS, Linalg::Order ORDER, typename S>
+  void add(Linalg::Matrix<T, ROWS, COLS, ORDER> *matrix, S step) {
+    add(matrix, data<Linalg::Matrix<T, ROWS, COLS, ORDER>>, ROWS * COLS, step);
+  }
+
+  template <typename S> void add(Linalg::Tensor<T> *tensor, S step) {
+    add(tensor, data<Linalg::Tensor<T>>, tensor->size(), step);
+  }
+
+  template <typename S> void add(Layer::SparseDense<T> *layer, S step) {
+    add(layer, parameters, layer->parameters().size(), step);
+  }
+
+  void invalidate() { m_valid = false; }
+
+  // The training cost of the parameters as they are.
+  double cost() {
+    if (!m_valid) {
+      m_stats.cost = evaluate();
+      m_valid = true;
+    }
+
+    return m_stats.cost;
+  }
+
+  // One iteration. Returns the cost of the parameters it leaves.
+  double step() {
+    double current = cost();
+
+    for (size_t b = 0; b < m_blocks.size(); b++) {
+      const Block &block = m_blocks[b];
+      T *params = block.params(block.owner);
+      // Asking again marks the values modified, see Storage::modified.
+      auto f = [this, &block]() {
+        block.params(block.owner);
+        return evaluate();
+      };
+
+      if (block.step)
+        current = Mutation::costMutate(params, block.n, f, block.step, current);
+      else
+        current = Mutation::costMutate(params, block.n, f, block.stddev,
+                                       current);
+      block.params(block.owner);
+    }
+
+    m_stats.cost = current;
+    m_stats.iterations++;
+    return current;
+  }
+
+  // Steps until the target cost, an iteration or time limit or the patience
+  // is reached. heldOut() returns the held-out cost of the parameters as they
+  // are; it is also run once at the end if its last run is out of date.
+  template <typename H> const Stats &run(H heldOut) {
+    const auto start = std::chrono::steady_clock::now();
+    const double before = m_stats.seconds;
+    size_t stale = 0;
+
+    while (!done()) {
+      step();
+
+      auto now = std::chrono::steady_clock::now();
+      m_stats.seconds =
+          before + std::chrono::duration<double>(now - start).count();
+
+      if (m_config.evaluateEvery == 0 ||
+          m_stats.iterations % m_config.evaluateEvery != 0)
+        continue;
+
+      if (evaluateHeldOut(heldOut)) {
+        stale = 0;
+      } else if (m_config.patience > 0 && ++stale >= m_config.patience) {
+        break;
+      }
+    }
+
+    if (m_heldOutAt != m_stats.iterations)
+      evaluateHeldOut(heldOut);
+
+    if (m_config.verbose)
+      printf("\n");
+
+    return m_stats;
+  }
+
+  // run() without a held-out set.
+  const Stats &run() { return run(nullptr); }
+
+  const Stats &stats() const { return m_stats; }
+
+private:
+  struct Block {
+    void *owner;
+    T *(*params)(void *);
+    size_t n;
+    T stddev;
+    Mutation::Adaptive<T> *step;
+  };
+
+  // Containers are asked for their values before every step, so copy on
+  // write never leaves the loop with a stale pointer. Matrix and Tensor hand
+  // them out through write(), which also marks them modified.
+  static T *values(void *params) { return static_cast<T *>(params); }
+
+  template <typename C> static T *data(void *owner) {
+    return static_cast<C *>(owner)->data();
+  }
+
+  static T *parameters(void *layer) {
+    return static_cast<Layer::SparseDense<T> *>(layer)->parameters().data();
+  }
+
+  bool done() {
+    return cost() <= m_config.targetCost ||
+           (m_config.maxIterations > 0 &&
+            m_stats.iterations >= m_config.maxIterations) ||
+           (m_config.maxSeconds > 0 && m_stats.seconds >= m_config.maxSeconds);
+  }
+
+  void add(void *owner, T *(*params)(void *), size_t n, T stddev) {
+    push(owner, params, n, stddev, NULL);
+  }
+
+  void add(void *owner, T *(*params)(void *), size_t n,
+           Mutation::Adaptive<T> *step) {
+    push(owner, params, n, 0, step);
+  }
+
+  void push(void *owner, T *(*params)(void *), size_t n, T stddev,
+            Mutation::Adaptive<T> *step) {
+    ASSERT(n > 0);
+    m_blocks.push(Block{owner, params, n, stddev, step});
+    m_valid = false;
+  }
+
+  double evaluate() {
+    m_stats.evaluations++;
+    return m_f();
+  }
+
+  // Returns true if the held-out cost improved on the best one so far.
+  template <typename H> bool evaluateHeldOut(H &heldOut) {
+    bool improved = false;
+    m_heldOutAt = m_stats.iterations;
+
+    if constexpr (!std::is_null_pointer<H>::value) {
+      m_stats.heldOutCost = heldOut();
+      m_stats.heldOutEvaluations++;
+      improved = m_stats.heldOutCost < m_stats.bestHeldOutCost;
+      m_stats.bestHeldOutCost =
+          Util::min(m_stats.bestHeldOutCost, m_stats.heldOutCost);
+    }
+
+    if (m_config.verbose) {
+      printf("Iteration %zu, the error is %f", m_stats.iterations,
+             m_stats.cost);
+      if constexpr (!std::is_null_pointer<H>::value)
+        printf(", held-out %f", m_stats.heldOutCost);
+      printf("          \r");
+      fflush(stdout);
+    }
+
+    return improved;
+  }
+
+  F m_f;
+  Config m_config;
+  Container::Vector<Block> m_blocks;
+  Stats m_stats;
+  bool m_valid = false;
+  size_t m_heldOutAt = std::numeric_limits<size_t>::max();
+};
+
+template <typename T, typename F>
+Loop<T, F> loop(F f, const Config &config = Config()) {
+  return Loop<T, F>(f, config);
+}
+
+} // namespace Train
+
+namespace Island {
+
+// Island-model evolution over forked worker processes. Every island evolves
+// its own population with its own RNG stream. Every migrationInterval
+// generations it publishes its best genomes into its ring in shared memory,
+// then takes in the new migrants of its neighbours in the topology in place of
+// its worst members. Islands only talk through the rings, so the same scheme
+// works with any transport that moves (score, genome) records.
+
+enum class Topology {
+  // Island i receives from island i - 1.
+  Ring,
+  // Every island receives from every other island.
+  FullyConnected,
+  // Every exchange, each island receives from one other island picked at
+  // random.
+  Random,
+};
+
+struct Config {
+  size_t islands = 4;
+  size_t population = 16;
+  size_t generations = 1000;
+  size_t migrationInterval = 20;
+  size_t migrants = 2;
+  Topology topology = Topology::Ring;
+  // Gaussian mutation: each gene is moved with probability rate.
+  double sigma = 0.01;
+  double rate = 0.1;
+  // All islands stop once one of them reaches this cost.
+  double targetCost = 0;
+  uint64_t seed = 1;
+  // Prints the best cost over all islands while the run is going.
+  bool verbose = false;
+};
+
+template <typename T> struct Result {
+  Container::Vector<T> genome;
+  double cost;
+  size_t island;
+  // Best cost of every island at the end of the run. Islands whose process
+  // failed report the largest double.
+  Container::Vector<double> islandCosts;
+};
+
+// Single-producer broadcast ring of (score, genome) records. Readers keep
+// their own cursor. A record overwritten while being read is detected through
+// its sequence number and skipped, so a slow reader only ever loses migrants.
+template <typename T> class MigrationRing {
+public:
+  MigrationRing(void *memory, size_t genomeSize, size_t slots) {
+    m_memory = static_cast<char *>(memory);
+    m_genomeSize = genomeSize;
+    m_slots = slots;
+  }
+
+  static size_t bytes(size_t genomeSize, size_t slots) {
+    return lineSize + slots * slotBytes(genomeSize);
+  }
+
+  // Must run once on zeroed memory before any process uses the ring.
+  void init() {
+    new (m_memory) std::atomic<uint64_t>(0);
+    for (size_t i = 0; i < m_slots; i++)
+      new (slot(i)) std::atomic<uint64_t>(0);
+  }
+
+  void publish(const T *genome, double score) {
+    const uint64_t entry = head()->load(std::memory_order_relaxed);
+    char *s = slot(entry % m_slots);
+    auto *seq = reinterpret_cast<std::atomic<uint64_t> *>(s);
+
+    seq->store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(s + sizeof(uint64_t), &score, sizeof(score));
+    memcpy(s + 2 * sizeof(uint64_t), genome, m_genomeSize * sizeof(T));
+    seq->store(entry + 1, std::memory_order_release);
+
+    head()->store(entry + 1, std::memory_order_release);
+  }
+
+  // Copies the next record after *cursor, if any, and advances the cursor.
+  bool next(uint64_t *cursor, T *genome, double *score) {
+    const uint64_t end = head()->load(std::memory_order_acquire);
+
+    if (end > m_slots && *cursor < end - m_slots)
+      *cursor = end - m_slots;
+
+    while (*cursor < end) {
+      const uint64_t entry = (*cursor)++;
+      const char *s = slot(entry % m_slots);
+      auto *seq = reinterpret_cast<const std::atomic<uint64_t> *>(s);
+
+      if (seq->load(std::memory_order_acquire) != entry + 1)
+        continue;
+
+      memcpy(score, s + sizeof(uint64_t), sizeof(*score));
+      memcpy(genome, s + 2 * sizeof(uint64_t), m_genomeSize * sizeof(T));
+      std::atomic_thread_fence(std::memory_order_acquire);
+
+      if (seq->load(std::memory_order_relaxed) == entry + 1)
+        return true;
+    }
+
+    return false;
+  }
+
+private:
+  static constexpr size_t lineSize = 64;
+
+  static size_t slotBytes(size_t genomeSize) {
+    const size_t raw = 2 * sizeof(uint64_t) + genomeSize * sizeof(T);
+    return (raw + lineSize - 1) / lineSize * lineSize;
+  }
+
+  std::atomic<uint64_t> *head() {
+    return reinterpret_cast<std::atomic<uint64_t> *>(m_memory);
+  }
+
+  char *slot(size_t i) {
+    return m_memory + lineSize + i * slotBytes(m_genomeSize);
+  }
+
+  char *m_memory;
+  size_t m_genomeSize;
+  size_t m_slots;
+};
+
+// Per-island state visible to the parent process.
+struct Status {
+  std::atomic<uint64_t> generation;
+  std::atomic<double> cost;
+  std::atomic<uint32_t> done;
+};
+
+// Evolves one island. Runs inside the forked worker.
+template <typename T, typename Init, typename Fitness>
+void evolve(const Config &config, size_t island, size_t genomeSize,
+            Init &init, Fitness &fitness, MigrationRing<T> *rings,
+            Status *status, std::atomic<uint32_t> *stop, T *best) {
+  std::seed_seq seq{config.seed, static_cast<uint64_t>(island)};
+  std::mt19937_64 rng(seq);
+  std::normal_distribution<double> normal(0, config.sigma);
+  std::uniform_real_distribution<double> prob(0, 1);
+
+  const size_t pop = config.population;
+  Container::Vector<T> genomes;
+  Container::Vector<double> costs;
+  Container::Vector<T> scratch;
+  Container::Vector<uint64_t> cursors;
+
+  for (size_t i = 0; i < pop * genomeSize; i++)
+    genomes.push(0);
+  for (size_t i = 0; i < genomeSize; i++)
+    scratch.push(0);
+  for (size_t i = 0; i < config.islands; i++)
+    cursors.push(0);
+
+  for (size_t p = 0; p < pop; p++) {
+    init(genomes.data() + p * genomeSize, rng);
+    costs.push(fitness(genomes.data() + p * genomeSize));
+  }
+
+  auto argBest = [&]() {
+    size_t b = 0;
+    for (size_t p = 1; p < pop; p++)
+      b = costs[p] < costs[b] ? p : b;
+    return b;
+  };
+
+  auto argWorst = [&]() {
+    size_t w = 0;
+    for (size_t p = 1; p < pop; p++)
+      w = costs[p] > costs[w] ? p : w;
+    return w;
+  };
+
+  auto receive = [&](size_t source) {
+    double score = 0;
+    while (rings[source].next(&cursors[source], scratch.data(), &score)) {
+      const size_t w = argWorst();
+      if (score < costs[w]) {
+        memcpy(genomes.data() + w * genomeSize, scratch.data(),
+               genomeSize * sizeof(T));
+        costs[w] = score;
+      }
+    }
+  };
+
+  for (size_t g = 0; g < config.generations; g++) {
+    if (stop->load(std::memory_order_relaxed))
+      break;
+
+    for (size_t p = 0; p < pop; p++) {
+      T *parent = genomes.data() + p * genomeSize;
+      memcpy(scratch.data(), parent, genomeSize * sizeof(T));
+
+      for (size_t i = 0; i < genomeSize; i++)
+        if (prob(rng) < config.rate)
+          scratch[i] += normal(rng);
+
+      const double cost = fitness(scratch.data());
+      if (cost <= costs[p]) {
+        memcpy(parent, scratch.data(), genomeSize * sizeof(T));
+        costs[p] = cost;
+      }
+    }
+
+    if ((g + 1) % config.migrationInterval == 0 && config.islands > 1) {
+      // Publish the best migrants, best first.
+      Container::Vector<size_t> order;
+      for (size_t p = 0; p < pop; p++)
+        order.push(p);
+      const size_t n = Util::min(config.migrants, pop);
+      std::partial_sort(order.data(), order.data() + n, order.data() + pop,
+                        [&](size_t a, size_t b) { return costs[a] < costs[b]; });
+      for (size_t m = 0; m < n; m++)
+        rings[island].publish(genomes.data() + order[m] * genomeSize,
+                              costs[order[m]]);
+
+      const size_t k = config.islands;
+      switch (config.topology) {
+      case Topology::Ring:
+        receive((island + k - 1) % k);
+        break;
+      case Topology::FullyConnected:
+        for (size_t source = 0; source < k; source++)
+          if (source != island)
+            receive(source);
+        break;
+      case Topology::Random: {
+        const size_t offset = 1 + rng() % (k - 1);
+        receive((island + offset) % k);
+        break;
+      }
+      }
+    }
+
+    const double bestCost = costs[argBest()];
+    status->generation.store(g + 1, std::memory_order_relaxed);
+    status->cost.store(bestCost, std::memory_order_relaxed);
+
+    if (bestCost <= config.targetCost)
+      stop->store(1, std::memory_order_relaxed);
+  }
+
+  const size_t b = argBest();
+  memcpy(best, genomes.data() + b * genomeSize, genomeSize * sizeof(T));
+  status->cost.store(costs[b], std::memory_order_relaxed);
+  status->done.store(1, std::memory_order_release);
+}
+
+// Forks config.islands workers and waits for them. init(T *genome, rng) fills
+// a random genome, fitness(const T *genome) returns a cost to minimise. Both
+// run in the workers, each of which also reseeds NNKek::gen and rand() from
+// its own stream. Returns nothing if no island finished.
+template <typename T, typename Init, typename Fitness>
+Container::Option<Result<T>> run(const Config &config, size_t genomeSize,
+                                 Init init, Fitness fitness) {
+  ASSERT(config.islands > 0 && config.population > 0);
+  ASSERT(config.migrationInterval > 0);
+
+  const size_t slots = Util::max<size_t>(4 * config.migrants, 1);
+  const size_t ringBytes = MigrationRing<T>::bytes(genomeSize, slots);
+  const size_t bestBytes = (genomeSize * sizeof(T) + 63) / 64 * 64;
+  const size_t bytes = 64 + config.islands * (sizeof(Status) + 64) +
+                       config.islands * (ringBytes + bestBytes);
+
+  void *memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED)
+    return Container::Option<Result<T>>();
+
+  char *cursor = static_cast<char *>(memory);
+  auto *stop = new (cursor) std::atomic<uint32_t>(0);
+  cursor += 64;
+
+  const double worst = std::numeric_limits<double>::max();
+
+  Status *status = reinterpret_cast<Status *>(cursor);
+  for (size_t i = 0; i < config.islands; i++) {
+    new (&status[i].generation) std::atomic<uint64_t>(0);
+    new (&status[i].cost) std::atomic<double>(worst);
+    new (&status[i].done) std::atomic<uint32_t>(0);
+  }
+  cursor += (config.islands * sizeof(Status) + 63) / 64 * 64;
+
+  Container::Vector<MigrationRing<T>> rings;
+  for (size_t i = 0; i < config.islands; i++) {
+    rings.push(MigrationRing<T>(cursor, genomeSize, slots));
+    rings[i].init();
+    cursor += ringBytes;
+  }
+
+  T *best = reinterpret_cast<T *>(cursor);
+
+  fflush(stdout);
+  fflush(stderr);
+
+  Container::Vector<pid_t> children;
+  for (size_t i = 0; i < config.islands; i++) {
+    const pid_t pid = fork();
+
+    if (pid == 0) {
+      gen.seed(config.seed * 1000003 + i);
+      srand(static_cast<unsigned>(config.seed * 1000003 + i));
+      evolve<T>(config, i, genomeSize, init, fitness, rings.data(), &status[i],
+                stop, reinterpret_cast<T *>(reinterpret_cast<char *>(best) +
+                                            i * bestBytes));
+      fflush(stdout);
+      _exit(0);
+    }
+
+    if (pid > 0)
+      children.push(pid);
+  }
+
+  // Only our own islands are waited for, so that other children of the caller
+  // are left for it to reap.
+  size_t running = children.size();
+  while (running > 0) {
+    for (size_t i = 0; i < children.size(); i++) {
+      if (children[i] == 0)
+        continue;
+
+      int wstatus = 0;
+      const pid_t pid =
+          waitpid(children[i], &wstatus, config.verbose ? WNOHANG : 0);
+      if (pid > 0 || (pid < 0 && errno != EINTR)) {
+        children[i] = 0;
+        running--;
+      }
+    }
+
+    if (running > 0 && config.verbose) {
+      double bestCost = worst;
+      uint64_t generation = 0;
+      for (size_t i = 0; i < config.islands; i++) {
+        bestCost = Util::min(bestCost, status[i].cost.load());
+        generation = Util::max<uint64_t>(generation, status[i].generation);
+      }
+      printf("Generation %lu, the best error is %f                      \r",
+             static_cast<unsigned long>(generation), bestCost);
+      fflush(stdout);
+      usleep(100000);
+    }
+  }
+
+  Result<T> result;
+  result.cost = worst;
+  result.island = 0;
+  for (size_t i = 0; i < config.islands; i++) {
+    const bool done = status[i].done.load(std::memory_order_acquire);
+    const double cost = done ? status[i].cost.load() : worst;
+    result.islandCosts.push(cost);
+
+    if (done && (result.genome.size() == 0 || cost < result.cost)) {
+      const T *genome = reinterpret_cast<const T *>(
+          reinterpret_cast<const char *>(best) + i * bestBytes);
+      result.genome = Container::Vector<T>();
+      for (size_t g = 0; g < genomeSize; g++)
+        result.genome.push(genome[g]);
+      result.cost = cost;
+      result.island = i;
+    }
+  }
+
+  munmap(memory, bytes);
+
+  if (result.genome.size() == 0)
+    return Container::Option<Result<T>>();
+
+  return Container::Option<Result<T>>(result);
+}
+
+} // namespace Island
+
+namespace Checkpoint {
+
+// The optimizer state as a flat byte image. Fields are read back with get()
+// in the order they were put(), so the training loop owns the layout:
+//
+//   state.put(iteration);
+//   state.put(NNKek::gen);
+//   state.putArray(layer.m_matrix.data(), layer.m_matrix.size());
+//
+// Only trivially copyable values go in, which includes std::mt19937.
+class State {
+public:
+  State() {}
+
+  State(const State &other) { *this = other; }
+
+  State &operator=(const State &other) {
+    if (this != &other) {
+      ASSERT(reserve(other.m_size));
+      if (other.m_size > 0)
+        memcpy(m_bytes, other.m_bytes, other.m_size);
+      m_size = other.m_size;
+      m_cursor = other.m_cursor;
+    }
+
+    return *this;
+  }
+
+  ~State() { free(m_bytes); }
+
+  void swap(State &other) {
+    Util::swap(m_bytes, other.m_bytes);
+    Util::swap(m_size, other.m_size);
+    Util::swap(m_capacity, other.m_capacity);
+    Util::swap(m_cursor, other.m_cursor);
+  }
+
+  void clear() {
+    m_size = 0;
+    m_cursor = 0;
+  }
+
+  template <typename T> void put(const T &value) { putArray(&value, 1); }
+
+  template <typename T> void putArray(const T *values, size_t n) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "checkpoint fields must be trivially copyable");
+    ASSERT(reserve(m_size + n * sizeof(T)));
+    memcpy(m_bytes + m_size, values, n * sizeof(T));
+    m_size += n * sizeof(T);
+  }
+
+  template <typename T> bool get(T *value) { return getArray(value, 1); }
+
+  template <typename T> bool getArray(T *values, size_t n) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "checkpoint fields must be trivially copyable");
+    if (m_cursor + n * sizeof(T) > m_size)
+      return false;
+
+    memcpy(values, m_bytes + m_cursor, n * sizeof(T));
+    m_cursor += n * sizeof(T);
+    return true;
+  }
+
+  // Rewinds get() to the first field.
+  void rewind() { m_cursor = 0; }
+
+  size_t size() const { return m_size; }
+
+  bool save(const char *path) const {
+    Fs::Writer w(path);
+    w.writeArray(fileMagic, sizeof(fileMagic));
+    w.write(fileVersion);
+    w.write(static_cast<uint64_t>(m_size));
+    w.writeArray(m_bytes, m_size);
+    w.write(checksum());
+    return w.sync() && w.close();
+  }
+
+  bool load(const char *path) {
+    Fs::Reader r(path);
+    char magic[sizeof(fileMagic)];
+    uint32_t version = 0;
+    uint64_t size = 0;
+    uint64_t sum = 0;
+
+    if (!r.readArray(magic, sizeof(magic)) || !r.read(&version) ||
+        !r.read(&size) || memcmp(magic, fileMagic, sizeof(magic)) != 0 ||
+        version != fileVersion)
+      return false;
+
+    // The size is not covered by the checksum yet. A torn header must not
+    // make it allocate more than the file still holds.
+    clear();
+    if (size > r.remaining() || !reserve(size))
+      return false;
+    m_size = size;
+    if (!r.readArray(m_bytes, size) || !r.read(&sum) ||
+        sum != checksum()) {
+      clear();
+      return false;
+    }
+
+    return true;
+  }
+
+private:
+  // Returns false, keeping the old buffer, if the memory is not there.
+  bool reserve(size_t size) {
+    if (size <= m_capacity)
+      return true;
+
+    const size_t capacity = Util::max(size, 2 * m_capacity);
+    char *bytes = static_cast<char *>(realloc(m_bytes, capacity));
+    if (bytes == NULL)
+      return false;
+
+    m_bytes = bytes;
+    m_capacity = capacity;
+    return true;
+  }
+
+  // FNV-1a, to reject files cut short by a crash before the rename.
+  uint64_t checksum() const {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < m_size; i++) {
+      hash ^= static_cast<unsigned char>(m_bytes[i]);
+      hash *= 1099511628211ull;
+    }
+    return hash;
+  }
+
+  static constexpr char fileMagic[8] = {'N', 'N', 'K', 'E', 'K', 'C', 'K', 'P'};
+  static constexpr uint32_t fileVersion = 1;
+
+  char *m_bytes = NULL;
+  size_t m_size = 0;
+  size_t m_capacity = 0;
+  size_t m_cursor = 0;
+};
+
+// Writes State to path + ".tmp", syncs it and renames it over path, so path
+// always holds a complete checkpoint.
+inline bool save(const char *path, const State &state) {
+  const size_t length = strlen(path);
+  char *tmp = static_cast<char *>(malloc(length + 5));
+  memcpy(tmp, path, length);
+  memcpy(tmp + length, ".tmp", 5);
+
+  bool ok = state.save(tmp) && rename(tmp, path) == 0;
+  if (!ok)
+    remove(tmp);
+
+  free(tmp);
+  return ok;
+}
+
+inline bool load(const char *path, State *state) { return state->load(path); }
+
+// Saves checkpoints on a background thread. save() copies the state into a
+// spare buffer and returns, so the loop only pays for a memcpy. If the disk
+// falls behind, a newer pending snapshot replaces the one not yet started.
+class Writer {
+public:
+  explicit Writer(const char *path) : m_path(path, strlen(path)) {
+    m_thread = std::thread([this]() { run(); });
+  }
+
+  Writer(const Writer &) = delete;
+  Writer &operator=(const Writer &) = delete;
+
+  ~Writer() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_wake.notify_all();
+    m_thread.join();
+  }
+
+  void save(const State &state) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_pending = state;
+      m_hasPending = true;
+    }
+    m_wake.notify_all();
+  }
+
+  // Waits until every snapshot handed to save() is on disk. Returns false if
+  // any write failed.
+  bool flush() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_idle.wait(lock, [this]() { return !m_hasPending && !m_writing; });
+    return m_ok;
+  }
+
+  size_t written() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_written;
+  }
+
+private:
+  void run() {
+    State writing;
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    for (;;) {
+      m_wake.wait(lock, [this]() { return m_stop || m_hasPending; });
+      if (!m_hasPending)
+        return;
+
+      // Swapping keeps both buffers allocated between checkpoints.
+      writing.swap(m_pending);
+      m_hasPending = false;
+      m_writing = true;
+
+      lock.unlock();
+      const bool ok = Checkpoint::save(m_path.c_str(), writing);
+      lock.lock();
+
+      m_ok = m_ok && ok;
+      m_written += ok;
+      m_writing = false;
+      m_idle.notify_all();
+    }
+  }
+
+  Container::String m_path;
+  std::thread m_thread;
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::condition_variable m_idle;
+  State m_pending;
+  bool m_hasPending = false;
+  bool m_writing = false;
+  bool m_stop = false;
+  bool m_ok = true;
+  size_t m_written = 0;
+};
+
+} // namespace Checkpoint
+
+namespace Farm {
+
+// Fitness evaluation spread over worker processes, on this machine or others.
+// A Coordinator listens on a TCP port and scores rows of flat genomes; each
+// worker holds its own copy of the dataset, connects, and runs fitness on the
+// genomes it is sent. Small genomes are packed several to a message, each
+// worker has several messages in flight so it never waits on the network, and
+// the candidates of a worker that disconnects or stops answering go back to
+// the others.
+//
+// Wire format, in host byte order (the hello magic rejects a mismatch): the
+// worker opens with a Hello. A batch is {type, count},
+// count uint64 ids and count genomes; a reply is {count, 0} followed by count
+// {uint64 id, double score}. A batch holds at most maxBatchBytes of ids and
+// genomes, or a single genome that is larger than that.
+
+constexpr uint32_t magic = 0x464b4e4e; // "NNKF"
+constexpr uint32_t version = 1;
+constexpr size_t maxBatchBytes = 1 << 26;
+// A connection that has not sent its Hello within this long is closed.
+constexpr int helloTimeoutMs = 5000;
+
+enum MessageType : uint32_t { Batch = 1, Shutdown = 2 };
+
+struct Config {
+  // 0 picks a free port; Coordinator::port() tells which.
+  uint16_t port = 0;
+  // Batches sent to a worker before its first reply comes back.
+  size_t inFlight = 4;
+  // Genomes are packed into one batch up to this many bytes, at most
+  // maxBatchBytes.
+  size_t batchBytes = 1 << 16;
+  // A worker with work outstanding that has not replied for this long is
+  // dropped. 0 waits forever.
+  int workerTimeoutMs = 0;
+  // evaluate() gives up if no worker is connected for this long.
+  int idleTimeoutMs = 10000;
+};
+
+struct Stats {
+  size_t evaluated = 0;
+  size_t batches = 0;
+  size_t requeued = 0;
+  size_t workersLost = 0;
+};
+
+inline bool sendAll(int fd, const void *buf, size_t n) {
+  const char *p = static_cast<const char *>(buf);
+  while (n > 0) {
+    ssize_t sent = send(fd, p, n, MSG_NOSIGNAL);
+    if (sent <= 0)
+      return false;
+    p += sent;
+    n -= sent;
+  }
+  return true;
+}
+
+inline bool recvAll(int fd, void *buf, size_t n) {
+  char *p = static_cast<char *>(buf);
+  while (n > 0) {
+    ssize_t got = recv(fd, p, n, 0);
+    if (got <= 0)
+      return false;
+    p += got;
+    n -= got;
+  }
+  return true;
+}
+
+inline void setTimeouts(int fd, int ms) {
+  timeval tv;
+  tv.tv_sec = ms / 1000;
+  tv.tv_usec = (ms % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+struct Hello {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t genes;
+  uint64_t geneBytes;
+};
+
+// A reusable message buffer.
+class Buffer {
+public:
+  Buffer() = default;
+  Buffer(const Buffer &) = delete;
+  Buffer &operator=(const Buffer &) = delete;
+
+  ~Buffer() { free(m_data); }
+
+  // Returns room for at least n bytes, or NULL if there is not enough memory;
+  // the old contents are not kept.
+  char *resize(size_t n) {
+    if (n > m_size) {
+      free(m_data);
+      m_data = static_cast<char *>(malloc(n));
+      m_size = m_data != NULL ? n : 0;
+    }
+    return m_data;
+  }
+
+private:
+  char *m_data = NULL;
+  size_t m_size = 0;
+};
+
+// Connects to host:port, retrying for up to timeoutMs while the coordinator
+// comes up. Returns the socket or -1.
+inline int connectTo(const char *host, uint16_t port, int timeoutMs) {
+  char service[8];
+  snprintf(service, sizeof(service), "%u", port);
+
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  for (int waited = 0;; waited += 50) {
+    addrinfo *res = NULL;
+    if (getaddrinfo(host, service, &hints, &res) == 0) {
+      for (addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+          freeaddrinfo(res);
+          return fd;
+        }
+        if (fd >= 0)
+          close(fd);
+      }
+      freeaddrinfo(res);
+    }
+
+    if (waited >= timeoutMs)
+      return -1;
+    usleep(50 * 1000);
+  }
+}
+
+// Serves fitness(const T *genome) for the coordinator at host:port until it
+// shuts down or goes away, and returns how many genomes it scored. Batches
+// are scored in the order they arrive, while the next ones wait in the socket.
+template <typename T, typename F>
+size_t work(const char *host, uint16_t port, size_t genomeSize, F fitness,
+            int connectTimeoutMs = 5000) {
+  const int fd = connectTo(host, port, connectTimeoutMs);
+  if (fd < 0)
+    return 0;
+
+  const int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  const Hello hello = {magic, version, genomeSize, sizeof(T)};
+  Buffer in;
+  Buffer out;
+  size_t scored = 0;
+  uint32_t header[2];
+
+  if (!sendAll(fd, &hello, sizeof(hello))) {
+    close(fd);
+    return 0;
+  }
+
+  // The count comes from the network, so it is checked against the batch
+  // size the coordinator keeps to before anything is allocated for it.
+  const size_t entryBytes = sizeof(uint64_t) + genomeSize * sizeof(T);
+  const size_t maxCount = Util::max<size_t>(maxBatchBytes / entryBytes, 1);
+
+  while (recvAll(fd, header, sizeof(header)) && header[0] == Batch &&
+         header[1] <= maxCount) {
+    const size_t n = header[1];
+    const size_t bytes = n * entryBytes;
+    char *batch = in.resize(bytes);
+    if (batch == NULL || !recvAll(fd, batch, bytes))
+      break;
+
+    const uint64_t *ids = reinterpret_cast<const uint64_t *>(batch);
+    const T *genomes = reinterpret_cast<const T *>(batch + n * 8);
+
+    char *reply = out.resize(8 + n * 16);
+    if (reply == NULL)
+      break;
+    const uint32_t replyHeader[2] = {static_cast<uint32_t>(n), 0};
+    memcpy(reply, replyHeader, sizeof(replyHeader));
+
+    for (size_t i = 0; i < n; i++) {
+      const double score = fitness(genomes + i * genomeSize);
+      memcpy(reply + 8 + i * 16, &ids[i], 8);
+      memcpy(reply + 8 + i * 16 + 8, &score, 8);
+    }
+
+    if (!sendAll(fd, reply, 8 + n * 16))
+      break;
+    scored += n;
+  }
+
+  close(fd);
+  return scored;
+}
+
+template <typename T> class Coordinator {
+public:
+  explicit Coordinator(size_t genomeSize, Config config = Config())
+      : m_genomeSize(genomeSize), m_config(config) {
+    ASSERT(config.inFlight > 0);
+    ASSERT(config.batchBytes <= maxBatchBytes);
+    m_listen = socket(AF_INET, SOCK_STREAM, 0);
+    const int one = 1;
+    setsockopt(m_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    sa.sin_port = htons(config.port);
+    socklen_t len = sizeof(sa);
+    auto *p = reinterpret_cast<sockaddr *>(&sa);
+
+    if (m_listen < 0 || bind(m_listen, p, sizeof(sa)) != 0 ||
+        listen(m_listen, 128) != 0 || getsockname(m_listen, p, &len) != 0) {
+      if (m_listen >= 0)
+        close(m_listen);
+      m_listen = -1;
+      return;
+    }
+
+    m_port = ntohs(sa.sin_port);
+  }
+
+  Coordinator(const Coordinator &) = delete;
+  Coordinator &operator=(const Coordinator &) = delete;
+
+  ~Coordinator() { shutdown(); }
+
+  // Tells every worker to exit and stops listening.
+  void shutdown() {
+    const uint32_t header[2] = {Shutdown, 0};
+    while (m_workers.size() > 0) {
+      Worker worker = m_workers.pop();
+      sendAll(worker.fd, header, sizeof(header));
+      close(worker.fd);
+    }
+
+    while (m_joining.size() > 0)
+      close(m_joining.pop().fd);
+
+    if (m_listen >= 0)
+      close(m_listen);
+    m_listen = -1;
+  }
+
+  bool ok() const { return m_listen >= 0; }
+
+  uint16_t port() const { return m_port; }
+
+  size_t workers() const { return m_workers.size(); }
+
+  const Stats &stats() const { return m_stats; }
+
+  // Forks n workers on this machine that serve fitness(const T *genome) until
+  // the coordinator goes away, and stores their pids. The stand-in for remote
+  // workers, which call work() themselves.
+  template <typename F> void spawnLocal(size_t n, F fitness, pid_t *pids) {
+    for (size_t i = 0; i < n; i++) {
+      const pid_t pid = fork();
+      if (pid == 0) {
+        // Holding the coordinator's sockets open would hide its shutdown
+        // from the other workers.
+        close(m_listen);
+        for (size_t w = 0; w < m_workers.size(); w++)
+          close(m_workers[w].fd);
+        for (size_t j = 0; j < m_joining.size(); j++)
+          close(m_joining[j].fd);
+
+        work<T>("127.0.0.1", m_port, m_genomeSize, fitness);
+        _exit(0);
+      }
+      pids[i] = pid;
+    }
+  }
+
+  // Accepts workers until there are n of them or timeoutMs has passed, and
+  // returns how many there are.
+  size_t waitForWorkers(size_t n, int timeoutMs) {
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(timeoutMs);
+
+    while (m_workers.size() < n) {
+      const int left = msUntil(deadline);
+      Container::Vector<pollfd> fds;
+      fds.push(pollfd{m_listen, POLLIN, 0});
+      for (size_t j = 0; j < m_joining.size(); j++)
+        fds.push(pollfd{m_joining[j].fd, POLLIN, 0});
+
+      if (left <= 0 || poll(fds.data(), fds.size(), left) < 0)
+        break;
+      greet(fds.data() + 1);
+      if (fds[0].revents & POLLIN)
+        accept();
+    }
+
+    return m_workers.size();
+  }
+
+  // Scores count genomes stored one after another in genomes. Returns false,
+  // with some scores unset, if there was no worker to send the rest to for
+  // idleTimeoutMs.
+  bool evaluate(const T *genomes, size_t count, double *scores) {
+    m_pending = Container::Vector<uint64_t>();
+    for (size_t i = count; i > 0; i--)
+      m_pending.push(i - 1);
+
+    size_t remaining = count;
+    auto idleSince = std::chrono::steady_clock::now();
+
+    while (remaining > 0) {
+      for (size_t w = 0; w < m_workers.size();) {
+        if (fill(&m_workers[w], genomes))
+          w++;
+        else
+          lose(w);
+      }
+
+      if (m_workers.size() > 0) {
+        idleSince = std::chrono::steady_clock::now();
+      } else if (msSince(idleSince) >= m_config.idleTimeoutMs) {
+        return false;
+      }
+
+      Container::Vector<pollfd> fds;
+      fds.push(pollfd{m_listen, POLLIN, 0});
+      for (size_t w = 0; w < m_workers.size(); w++)
+        fds.push(pollfd{m_workers[w].fd, POLLIN, 0});
+      for (size_t j = 0; j < m_joining.size(); j++)
+        fds.push(pollfd{m_joining[j].fd, POLLIN, 0});
+
+      const size_t polled = m_workers.size();
+      if (poll(fds.data(), fds.size(), 100) < 0)
+        continue;
+
+      // Walk backwards so that dropping a worker keeps the indices valid.
+      for (size_t w = m_workers.size(); w > 0; w--) {
+        Worker &worker = m_workers[w - 1];
+        const short events = fds[w].revents;
+        const bool stale = m_config.workerTimeoutMs > 0 &&
+                           worker.outstanding.size() > worker.head &&
+                           msSince(worker.heard) >= m_config.workerTimeoutMs;
+
+        if ((events & POLLIN) && receive(&worker, scores, &remaining))
+          continue;
+        if ((events & (POLLIN | POLLERR | POLLHUP | POLLNVAL)) || stale)
+          lose(w - 1);
+      }
+
+      greet(fds.data() + 1 + polled);
+      if (fds[0].revents & POLLIN)
+        accept();
+    }
+
+    m_stats.evaluated += count;
+    return true;
+  }
+
+private:
+  struct Worker {
+    int fd;
+    // Ids sent and not yet answered, oldest first from head.
+    Container::Vector<uint64_t> outstanding;
+    size_t head;
+    // Candidates in each batch in flight, oldest first from batchHead.
+    Container::Vector<uint32_t> batches;
+    size_t batchHead;
+    std::chrono::steady_clock::time_point heard;
+  };
+
+  // A connection whose Hello has not fully arrived yet.
+  struct Joining {
+    int fd;
+    Hello hello;
+    size_t got;
+    std::chrono::steady_clock::time_point since;
+  };
+
+  template <typename D> static int msSince(D since) {
+    auto elapsed = std::chrono::steady_clock::now() - since;
+    return std::chrono::duration_cast<std::chrono::milliseconds>(elapsed)
+        .count();
+  }
+
+  template <typename D> static int msUntil(D deadline) {
+    auto left = deadline - std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(left).count();
+  }
+
+  // Takes a new connection. It becomes a worker once greet() has read its
+  // Hello, so a client that connects and says nothing cannot stall the others.
+  void accept() {
+    const int fd = ::accept(m_listen, NULL, NULL);
+    if (fd < 0)
+      return;
+
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setTimeouts(fd, 5000);
+
+    Joining joining;
+    joining.fd = fd;
+    joining.got = 0;
+    joining.since = std::chrono::steady_clock::now();
+    m_joining.push(joining);
+  }
+
+  // Reads what has arrived of each Hello, given the poll results for the
+  // joining connections in order. Connections with a complete and matching
+  // Hello become workers; broken, mismatched or silent ones are closed.
+  void greet(const pollfd *fds) {
+    // Walk backwards so that dropping a connection keeps the indices valid.
+    for (size_t j = m_joining.size(); j > 0; j--) {
+      Joining &joining = m_joining[j - 1];
+      const short events = fds[j - 1].revents;
+      bool drop = msSince(joining.since) >= helloTimeoutMs;
+
+      if (events & (POLLIN | POLLERR | POLLHUP | POLLNVAL)) {
+        char *p = reinterpret_cast<char *>(&joining.hello) + joining.got;
+        const ssize_t got =
+            recv(joining.fd, p, sizeof(Hello) - joining.got, MSG_DONTWAIT);
+        if (got > 0)
+          joining.got += got;
+        else if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+          drop = true;
+      }
+
+      if (!drop && joining.got < sizeof(Hello))
+        continue;
+
+      const Hello &hello = joining.hello;
+      if (!drop && hello.magic == magic && hello.version == version &&
+          hello.genes == m_genomeSize && hello.geneBytes == sizeof(T)) {
+        Worker worker;
+        worker.fd = joining.fd;
+        worker.head = 0;
+        worker.batchHead = 0;
+        worker.heard = std::chrono::steady_clock::now();
+        m_workers.push(worker);
+      } else {
+        close(joining.fd);
+      }
+
+      Util::swap(m_joining[j - 1], m_joining[m_joining.size() - 1]);
+      m_joining.pop();
+    }
+  }
+
+  // Tops the worker up to inFlight batches. Returns false if it is gone.
+  bool fill(Worker *worker, const T *genomes) {
+    const size_t genomeBytes = m_genomeSize * sizeof(T);
+    const size_t perBatch = Util::max<size_t>(
+        m_config.batchBytes / (genomeBytes + sizeof(uint64_t)), 1);
+    const size_t slots = m_workers.size() * m_config.inFlight;
+
+    while (worker->batches.size() - worker->batchHead < m_config.inFlight &&
+           m_pending.size() > 0) {
+      if (worker->batches.size() == worker->batchHead)
+        worker->heard = std::chrono::steady_clock::now();
+
+      // Small enough that every worker gets a share of what is left.
+      const size_t share = (m_pending.size() + slots - 1) / slots;
+      const size_t n = Util::min(perBatch, share);
+      const size_t bytes = 8 + n * (sizeof(uint64_t) + genomeBytes);
+      char *p = m_buffer.resize(bytes);
+      ASSERT(p != NULL);
+
+      const uint32_t header[2] = {Batch, static_cast<uint32_t>(n)};
+      memcpy(p, header, sizeof(header));
+      uint64_t *ids = reinterpret_cast<uint64_t *>(p + 8);
+      char *values = p + 8 + n * sizeof(uint64_t);
+
+      for (size_t i = 0; i < n; i++) {
+        ids[i] = m_pending.pop();
+        memcpy(values + i * genomeBytes, genomes + ids[i] * m_genomeSize,
+               genomeBytes);
+        worker->outstanding.push(ids[i]);
+      }
+      worker->batches.push(n);
+      m_stats.batches++;
+
+      if (!sendAll(worker->fd, p, bytes))
+        return false;
+    }
+
+    return true;
+  }
+
+  // Reads one reply. Returns false if the worker is gone.
+  bool receive(Worker *worker, double *scores, size_t *remaining) {
+    uint32_t header[2];
+    if (!recvAll(worker->fd, header, sizeof(header)))
+      return false;
+
+    const size_t n = header[0];
+    if (worker->batchHead == worker->batches.size() ||
+        worker->batches[worker->batchHead] != n)
+      return false;
+
+    struct Score {
+      uint64_t id;
+      double score;
+    };
+    auto *replies = reinterpret_cast<Score *>(m_buffer.resize(n * 16));
+    ASSERT(replies != NULL);
+    if (!recvAll(worker->fd, replies, n * sizeof(Score)))
+      return false;
+
+    for (size_t i = 0; i < n; i++) {
+      if (replies[i].id != worker->outstanding[worker->head + i])
+        return false;
+      scores[replies[i].id] = replies[i].score;
+    }
+
+    worker->head += n;
+    worker->batchHead++;
+    *remaining -= n;
+    worker->heard = std::chrono::steady_clock::now();
+
+    if (worker->batchHead == worker->batches.size()) {
+      worker->outstanding = Container::Vector<uint64_t>();
+      worker->batches = Container::Vector<uint32_t>();
+      worker->head = 0;
+      worker->batchHead = 0;
+    }
+
+    return true;
+  }
+
+  // Drops worker w and queues its unanswered candidates again.
+  void lose(size_t w) {
+    Worker &worker = m_workers[w];
+    for (size_t i = worker.head; i < worker.outstanding.size(); i++)
+      m_pending.push(worker.outstanding[i]);
+
+    m_stats.requeued += worker.outstanding.size() - worker.head;
+    m_stats.workersLost++;
+    close(worker.fd);
+
+    Util::swap(m_workers[w], m_workers[m_workers.size() - 1]);
+    m_workers.pop();
+  }
+
+  size_t m_genomeSize;
+  Config m_config;
+  int m_listen = -1;
+  uint16_t m_port = 0;
+  Container::Vector<Worker> m_workers;
+  Container::Vector<Joining> m_joining;
+  Container::Vector<uint64_t> m_pending;
+  Buffer m_buffer;
+  Stats m_stats;
+};
+
+} // namespace Farm
 
 } // namespace NNKek
 
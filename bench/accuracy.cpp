@@ -0,0 +1,413 @@
+// Time to accuracy: trains iris, wine, balance-scale, sine and two synthetic
+// datasets with each optimizer from fixed seeds, and writes one JSON object
+// per run to stdout with the wall time, cost evaluations and evaluations per
+// second it took to reach the task's target. Datasets whose files are missing
+// from the data directory are reported as skipped.
+//
+//   bench/accuracy.out [--data DIR] [--task NAME] [--seeds N]
+//                      [--max-seconds S] [--max-evaluations N]
+
+#include "NNKek.h"
+#include <chrono>
+
+using namespace NNKek;
+using Linalg::Tensor;
+
+struct Dataset {
+  Tensor<float> inputs;
+  // One-hot classes are stored as labels; regression targets as a tensor.
+  Container::Vector<size_t> labels;
+  Tensor<float> targets;
+  size_t classes = 0;
+};
+
+struct Task {
+  const char *name;
+  // Relative to the data directory, or NULL for generated datasets.
+  const char *file;
+  size_t hidden;
+  Activation::Kind activation;
+  // Classification tasks stop at a training accuracy of at least target,
+  // regression tasks at a mean squared error of at most target.
+  double target;
+};
+
+struct Options {
+  const char *data = "data";
+  const char *task = NULL;
+  size_t seeds = 3;
+  double maxSeconds = 10;
+  size_t maxEvaluations = 200000;
+};
+
+struct Result {
+  bool reached;
+  double seconds;
+  size_t evaluations;
+  double value;
+};
+
+// Scales every input column to zero mean and unit variance.
+void standardize(Tensor<float> *inputs) {
+  const size_t rows = inputs->shape(0);
+  const size_t cols = inputs->shape(1);
+
+  for (size_t c = 0; c < cols; c++) {
+    double sum = 0;
+    double sumSq = 0;
+    for (size_t r = 0; r < rows; r++) {
+      sum += (*inputs)(r, c);
+      sumSq += (*inputs)(r, c) * (*inputs)(r, c);
+    }
+
+    const double mean = sum / rows;
+    const double var = sumSq / rows - mean * mean;
+    const double scale = var > 0 ? 1 / std::sqrt(var) : 1;
+    for (size_t r = 0; r < rows; r++)
+      (*inputs)(r, c) = ((*inputs)(r, c) - mean) * scale;
+  }
+}
+
+Dataset fromRows(const Container::Vector<float> &values,
+                 const Container::Vector<size_t> &labels, size_t inputs,
+                 size_t classes) {
+  Dataset d;
+  d.inputs = Tensor<float>(labels.size(), inputs);
+  memcpy(d.inputs.data(), values.data(), values.size() * sizeof(float));
+  d.labels = labels;
+  d.classes = classes;
+  standardize(&d.inputs);
+  return d;
+}
+
+// Parses one line of a UCI file into its inputs and label, or returns false.
+typedef bool (*Parser)(const char *line, float *inputs, size_t *label);
+
+bool parseIris(const char *line, float *x, size_t *label) {
+  char name[64];
+  if (sscanf(line, "%f,%f,%f,%f,%63s", &x[0], &x[1], &x[2], &x[3], name) != 5)
+    return false;
+
+  *label = strcmp(name, "Iris-setosa") == 0       ? 0
+           : strcmp(name, "Iris-versicolor") == 0 ? 1
+                                                  : 2;
+  return true;
+}
+
+bool parseWine(const char *line, float *x, size_t *label) {
+  int cls;
+  int used;
+  if (sscanf(line, "%d%n", &cls, &used) != 1 || cls < 1 || cls > 3)
+    return false;
+
+  line += used;
+  for (size_t i = 0; i < 13; i++) {
+    if (sscanf(line, ",%f%n", &x[i], &used) != 1)
+      return false;
+    line += used;
+  }
+
+  *label = cls - 1;
+  return true;
+}
+
+bool parseBalance(const char *line, float *x, size_t *label) {
+  char cls;
+  if (sscanf(line, "%c,%f,%f,%f,%f", &cls, &x[0], &x[1], &x[2], &x[3]) != 5)
+    return false;
+
+  *label = cls == 'B' ? 0 : cls == 'L' ? 1 : 2;
+  return true;
+}
+
+Container::Option<Dataset> loadUci(const char *path, Parser parse,
+                                   size_t inputs, size_t classes) {
+  Container::Vector<float> values;
+  Container::Vector<size_t> labels;
+
+  bool found = Fs::readLines(path, [&](Container::String line) {
+    float x[16];
+    size_t label;
+    if (line.length() == 0 || !parse(line.c_str(), x, &label))
+      return;
+
+    for (size_t i = 0; i < inputs; i++)
+      values.push(x[i]);
+    labels.push(label);
+  });
+
+  if (!found || labels.size() == 0)
+    return Container::Option<Dataset>();
+
+  return Container::Option<Dataset>(fromRows(values, labels, inputs, classes));
+}
+
+// Gaussian blobs: samples of each class scattered around a random centre.
+// Always generated from the same seed, independent of the run seed.
+Dataset blobs(size_t samples, size_t inputs, size_t classes) {
+  std::mt19937 rng(samples * 31 + inputs);
+  std::normal_distribution<float> normal(0, 1);
+
+  Container::Vector<float> centres;
+  for (size_t i = 0; i < classes * inputs; i++)
+    centres.push(normal(rng));
+
+  Container::Vector<float> values;
+  Container::Vector<size_t> labels;
+  for (size_t s = 0; s < samples; s++) {
+    const size_t label = s % classes;
+    for (size_t i = 0; i < inputs; i++)
+      values.push(centres[label * inputs + i] + 0.6f * normal(rng));
+    labels.push(label);
+  }
+
+  return fromRows(values, labels, inputs, classes);
+}
+
+Dataset sine() {
+  Dataset d;
+  d.inputs = Tensor<float>(50, 1);
+  d.targets = Tensor<float>(50, 1);
+  for (size_t i = 0; i < 50; i++) {
+    float x = -5 + i * 0.2;
+    d.inputs(i, 0) = x / 10.0;
+    d.targets(i, 0) = std::sin(x);
+  }
+  return d;
+}
+
+Container::Option<Dataset> load(const Task &task, const Options &options) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/%s", options.data,
+           task.file ? task.file : "");
+
+  if (strcmp(task.name, "iris") == 0)
+    return loadUci(path, parseIris, 4, 3);
+  if (strcmp(task.name, "wine") == 0)
+    return loadUci(path, parseWine, 13, 3);
+  if (strcmp(task.name, "balance-scale") == 0)
+    return loadUci(path, parseBalance, 4, 3);
+  if (strcmp(task.name, "sine") == 0)
+    return Container::Option<Dataset>(sine());
+  if (strcmp(task.name, "blobs-16x4") == 0)
+    return Container::Option<Dataset>(blobs(1024, 16, 4));
+  return Container::Option<Dataset>(blobs(8192, 64, 10));
+}
+
+const Task tasks[] = {
+    {"iris", "iris.data", 8, Activation::Kind::Relu, 0.95},
+    {"wine", "wine.data", 8, Activation::Kind::Tanh, 0.95},
+    {"balance-scale", "balance-scale.data", 8, Activation::Kind::Relu, 0.9},
+    {"sine", NULL, 50, Activation::Kind::Tanh, 0.01},
+    {"blobs-16x4", NULL, 16, Activation::Kind::Relu, 0.95},
+    {"blobs-64x10", NULL, 32, Activation::Kind::Relu, 0.95},
+};
+
+// Counts cost evaluations and decides when a run is over.
+class Run {
+public:
+  Run(const Dataset &data, Model::Network<float> *net, double target,
+      const Options &options)
+      : m_data(data), m_net(net), m_target(target), m_options(options),
+        m_start(std::chrono::steady_clock::now()) {}
+
+  double cost() {
+    m_evaluations++;
+    auto outputs = m_net->forward(m_data.inputs);
+    if (m_data.classes == 0)
+      return Loss::mse(outputs, m_data.targets);
+    return Loss::crossEntropy(outputs, m_data.labels.data());
+  }
+
+  // Checks the current weights against the target every checkEvery
+  // evaluations, and returns true once the run should stop.
+  bool done() {
+    if (m_evaluations < m_nextCheck)
+      return false;
+
+    m_nextCheck = m_evaluations + checkEvery;
+    m_value = metric();
+    return reached() || m_evaluations >= m_options.maxEvaluations ||
+           seconds() >= m_options.maxSeconds;
+  }
+
+  Result result() {
+    m_value = metric();
+    return Result{reached(), seconds(), m_evaluations, m_value};
+  }
+
+private:
+  static constexpr size_t checkEvery = 32;
+
+  double metric() {
+    auto outputs = m_net->forward(m_data.inputs);
+    if (m_data.classes == 0)
+      return Loss::mse(outputs, m_data.targets);
+    return Loss::accuracy(outputs, m_data.labels.data());
+  }
+
+  bool reached() const {
+    return m_data.classes == 0 ? m_value <= m_target : m_value >= m_target;
+  }
+
+  double seconds() const {
+    auto now = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(now - m_start).count();
+  }
+
+  const Dataset &m_data;
+  Model::Network<float> *m_net;
+  double m_target;
+  const Options &m_options;
+  std::chrono::steady_clock::time_point m_start;
+  size_t m_evaluations = 0;
+  size_t m_nextCheck = 0;
+  double m_value = 0;
+};
+
+// Single-parameter hill climbing with a 1/5th-rule step size. The cost of
+// the incumbent is kept, so every step costs one evaluation.
+void costAdaptive(Model::Genome<float> *genome, Run *run) {
+  Mutation::Adaptive<float> step(0.1f);
+  auto cost = [&]() { return run->cost(); };
+
+  double score = run->cost();
+  while (!run->done())
+    score = Mutation::costMutate(genome->data(), genome->size(), cost, &step,
+                                 score);
+}
+
+// (1+8) evolution strategy: eight Gaussian children of the parent, the best
+// of which replaces it if it is no worse.
+void onePlusEight(Model::Genome<float> *genome, Run *run) {
+  const size_t n = genome->size();
+  const float rate = Util::min(1.0f, 8.0f / n);
+  Mutation::Adaptive<float> step(0.1f);
+  Container::Vector<float> parent;
+  Container::Vector<float> best;
+  parent.setCapacity(n);
+  best.setCapacity(n);
+  for (size_t i = 0; i < n; i++) {
+    parent.push(genome->data()[i]);
+    best.push(genome->data()[i]);
+  }
+
+  double score = run->cost();
+  while (!run->done()) {
+    double bestScore = std::numeric_limits<double>::max();
+
+    for (size_t c = 0; c < 8; c++) {
+      genome->load(parent.data());
+      Mutation::normalMutate(genome->data(), n, rate, step.sigma());
+      const double childScore = run->cost();
+      if (childScore < bestScore) {
+        bestScore = childScore;
+        genome->store(best.data());
+      }
+    }
+
+    step.report(bestScore < score);
+    if (bestScore <= score) {
+      score = bestScore;
+      memcpy(parent.data(), best.data(), n * sizeof(float));
+    }
+    genome->load(parent.data());
+  }
+}
+
+struct Optimizer {
+  const char *name;
+  void (*run)(Model::Genome<float> *, Run *);
+};
+
+const Optimizer optimizers[] = {
+    {"cost-adaptive", costAdaptive},
+    {"one-plus-eight", onePlusEight},
+};
+
+void runTask(const Task &task, const Options &options) {
+  auto loaded = load(task, options);
+  if (!loaded.is_some()) {
+    printf("{\"task\":\"%s\",\"status\":\"skipped\",\"reason\":\"cannot "
+           "read %s/%s\"}\n",
+           task.name, options.data, task.file);
+    fflush(stdout);
+    return;
+  }
+
+  const Dataset data = loaded.value();
+  const size_t samples = data.inputs.shape(0);
+  const size_t outputs = data.classes == 0 ? 1 : data.classes;
+
+  for (const Optimizer &optimizer : optimizers) {
+    for (size_t seed = 1; seed <= options.seeds; seed++) {
+      gen.seed(seed);
+
+      Model::Network<float> net;
+      net.setInputs(data.inputs.shape(1));
+      net.add(task.hidden, task.activation);
+      net.add(outputs, data.classes == 0 ? Activation::Kind::Tanh
+                                         : Activation::Kind::Linear);
+
+      Model::Genome<float> genome(&net);
+      Mutation::normalMutate(genome.data(), genome.size(), 0.5f);
+
+      Run run(data, &net, task.target, options);
+      optimizer.run(&genome, &run);
+      const Result r = run.result();
+
+      printf("{\"task\":\"%s\",\"optimizer\":\"%s\",\"seed\":%zu,"
+             "\"status\":\"%s\",\"samples\":%zu,\"parameters\":%zu,"
+             "\"metric\":\"%s\",\"target\":%g,\"value\":%g,"
+             "\"seconds\":%.6f,\"evaluations\":%zu,"
+             "\"evaluations_per_second\":%.1f}\n",
+             task.name, optimizer.name, seed,
+             r.reached ? "reached" : "limit", samples, genome.size(),
+             data.classes == 0 ? "mse" : "accuracy", task.target, r.value,
+             r.seconds, r.evaluations, r.evaluations / r.seconds);
+      fflush(stdout);
+    }
+  }
+}
+
+void usage() {
+  fprintf(stderr,
+          "Usage: accuracy.out [--data DIR] [--task NAME] [--seeds N]\n"
+          "                    [--max-seconds S] [--max-evaluations N]\n");
+}
+
+int main(int argc, char **argv) {
+  Options options;
+
+  for (int i = 1; i < argc; i += 2) {
+    if (i + 1 >= argc) {
+      usage();
+      return 1;
+    }
+
+    const char *flag = argv[i];
+    const char *value = argv[i + 1];
+
+    if (strcmp(flag, "--data") == 0)
+      options.data = value;
+    else if (strcmp(flag, "--task") == 0)
+      options.task = value;
+    else if (strcmp(flag, "--seeds") == 0 && atol(value) > 0)
+      options.seeds = atol(value);
+    else if (strcmp(flag, "--max-seconds") == 0 && atof(value) > 0)
+      options.maxSeconds = atof(value);
+    else if (strcmp(flag, "--max-evaluations") == 0 && atol(value) > 0)
+      options.maxEvaluations = atol(value);
+    else {
+      usage();
+      return 1;
+    }
+  }
+
+  for (const Task &task : tasks) {
+    if (options.task == NULL || strcmp(options.task, task.name) == 0)
+      runTask(task, options);
+  }
+
+  return 0;
+}
@@ -0,0 +1,161 @@
+// Cost evaluations needed to fit sin(x) on [-5, 5] with a 1-50-1 tanh network
+// from five random starts: costMutate with fixed and 1/5th-rule Adaptive step
+// sizes, and a (1+8) loop with log-normal self-adapted step sizes.
+
+#include "NNKek.h"
+#include <cmath>
+
+using namespace NNKek;
+
+typedef Layer::Dense<float, 1, 50> L1;
+typedef Layer::Dense<float, 50, 1> L2;
+
+constexpr size_t seeds = 5;
+constexpr size_t limit = 50000;
+constexpr double target = 0.01;
+
+struct Net {
+  L1 layer1;
+  L2 layer2;
+};
+
+size_t evaluations;
+
+double fitness(const Net &net) {
+  double error = 0;
+  size_t x = 0;
+  evaluations++;
+
+  for (float i = -5; i < 5; i += 0.2) {
+    Linalg::Vector<float, 1> v;
+    v[0] = i / 10.0;
+    auto hidden = Activation::tanh(net.layer1.forward(v));
+    auto result = Activation::tanh(net.layer2.forward(hidden))[0];
+    error += (std::sin(i) - result) * (std::sin(i) - result);
+    x++;
+  }
+
+  return error / x;
+}
+
+Net start(size_t seed) {
+  gen.seed(seed);
+  Net net;
+  Mutation::normalMutate(&net.layer1.m_matrix, 1.0f);
+  Mutation::normalMutate(&net.layer2.m_matrix, 1.0f);
+  evaluations = 0;
+  return net;
+}
+
+void report(const char *name, size_t total, size_t solved,
+            const Mutation::Stats &stats) {
+  printf("%-30s %6zu evaluations  %zu/%zu solved  improved %4.1f%%\n", name,
+         total / seeds, solved, seeds, 100 * stats.rate());
+}
+
+float step(float sigma) { return sigma; }
+
+Mutation::Adaptive<float> *step(Mutation::Adaptive<float> &sigma) {
+  return &sigma;
+}
+
+template <typename S> void climb(const char *name, float sigma) {
+  size_t total = 0;
+  size_t solved = 0;
+  Mutation::Stats stats;
+
+  for (size_t seed = 1; seed <= seeds; seed++) {
+    Net net = start(seed);
+    S step1(sigma);
+    S step2(sigma);
+    auto cost = [&]() { return fitness(net); };
+    double score = cost();
+
+    while (evaluations < limit && score > target) {
+      const double before = score;
+      Mutation::costMutate(&net.layer1.m_matrix, cost, step(step1));
+      Mutation::costMutate(&net.layer2.m_matrix, cost, step(step2));
+      score = cost();
+      stats.record(score < before);
+    }
+
+    total += evaluations;
+    solved += score <= target;
+  }
+
+  report(name, total, solved, stats);
+}
+
+// (1+children) selection: the best child replaces the parent, with its step
+// sizes, if it is no worse.
+template <bool PER_WEIGHT> void selfAdapt(const char *name, float sigma) {
+  constexpr size_t n1 = 2 * 50;
+  constexpr size_t n2 = 51 * 1;
+  constexpr size_t n = n1 + n2;
+  constexpr size_t children = 8;
+  size_t total = 0;
+  size_t solved = 0;
+  Mutation::Stats stats;
+
+  for (size_t seed = 1; seed <= seeds; seed++) {
+    Net parent = start(seed);
+    double score = fitness(parent);
+    float sigmas[n];
+    std::fill(sigmas, sigmas + n, sigma);
+
+    while (evaluations < limit && score > target) {
+      Net best = parent;
+      float bestSigmas[n];
+      double bestScore = std::numeric_limits<double>::max();
+
+      for (size_t c = 0; c < children; c++) {
+        Net child = parent;
+        float childSigmas[n];
+        std::copy(sigmas, sigmas + n, childSigmas);
+
+        if (PER_WEIGHT) {
+          Mutation::selfAdaptMutate(child.layer1.m_matrix.data(), childSigmas,
+                                    n1);
+          Mutation::selfAdaptMutate(child.layer2.m_matrix.data(),
+                                    childSigmas + n1, n2);
+        } else {
+          Mutation::selfAdaptMutate(&child.layer1.m_matrix, &childSigmas[0]);
+          Mutation::selfAdaptMutate(&child.layer2.m_matrix, &childSigmas[n1]);
+        }
+
+        const double childScore = fitness(child);
+        if (childScore < bestScore) {
+          best = child;
+          bestScore = childScore;
+          std::copy(childSigmas, childSigmas + n, bestSigmas);
+        }
+      }
+
+      stats.record(bestScore < score);
+      if (bestScore <= score) {
+        parent = best;
+        score = bestScore;
+        std::copy(bestSigmas, bestSigmas + n, sigmas);
+      }
+    }
+
+    total += evaluations;
+    solved += score <= target;
+  }
+
+  report(name, total, solved, stats);
+}
+
+int main(void) {
+  climb<float>("costMutate fixed 0.001", 0.001f);
+  climb<float>("costMutate fixed 0.1", 0.1f);
+  climb<float>("costMutate fixed 1", 1.0f);
+  climb<Mutation::Adaptive<float>>("costMutate adaptive 0.001", 0.001f);
+  climb<Mutation::Adaptive<float>>("costMutate adaptive 0.1", 0.1f);
+  climb<Mutation::Adaptive<float>>("costMutate adaptive 1", 1.0f);
+  selfAdapt<false>("self-adaptive per layer 0.001", 0.001f);
+  selfAdapt<false>("self-adaptive per layer 0.1", 0.1f);
+  selfAdapt<true>("self-adaptive per weight 0.001", 0.001f);
+  selfAdapt<true>("self-adaptive per weight 0.1", 0.1f);
+  return 0;
+}
@@ -0,0 +1,129 @@
+// A population of children cloned from one 64-256-256-10 parent, each
+// mutating only its last layer: deep copies against copy-on-write clones,
+// and plain forward passes against Model::PrefixCache.
+
+#include "NNKek.h"
+#include <chrono>
+
+using namespace NNKek;
+
+constexpr size_t children = 64;
+constexpr size_t rounds = 20;
+
+template <typename F> double usPer(size_t n, F f) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; i++)
+    f(i);
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::micro>(end - start).count() / n;
+}
+
+int main(void) {
+  Model::Network<float> parent;
+  parent.setInputs(64);
+  parent.add(256, Activation::Kind::Relu);
+  parent.add(256, Activation::Kind::Relu);
+  parent.add(10, Activation::Kind::Linear);
+  for (size_t l = 0; l < parent.depth(); l++)
+    Mutation::testMutate(&parent.layer(l).m_matrix, 1.0);
+
+  const size_t last = parent.depth() - 1;
+  Container::Vector<Model::Network<float>> population;
+  for (size_t i = 0; i < children; i++)
+    population.push(parent);
+
+  // Writing to every layer forces the private copies a deep clone makes.
+  double deep = usPer(children * rounds, [&](size_t i) {
+    Model::Network<float> &child = population[i % children];
+    child = parent;
+    for (size_t l = 0; l < child.depth(); l++)
+      child.layer(l).m_matrix.data();
+    Mutation::normalMutate(&child.layer(last).m_matrix, 0.1f, 0.1f);
+  });
+
+  double cow = usPer(children * rounds, [&](size_t i) {
+    Model::Network<float> &child = population[i % children];
+    child = parent;
+    Mutation::normalMutate(&child.layer(last).m_matrix, 0.1f, 0.1f);
+  });
+
+  size_t total = 0;
+  size_t owned = 0;
+  for (size_t i = 0; i < children; i++) {
+    for (size_t l = 0; l < parent.depth(); l++) {
+      const auto &storage = population[i].layer(l).m_matrix.storage();
+      total += storage.size() * sizeof(float);
+      owned += storage.users() == 1 ? storage.size() * sizeof(float) : 0;
+    }
+  }
+
+  printf("clone + mutate last layer  deep %7.2f us  copy-on-write %7.2f us  "
+         "speedup %5.2fx\n",
+         deep, cow, deep / cow);
+  printf("population parameters  %zu KiB, of which private %zu KiB\n",
+         total / 1024, owned / 1024);
+
+  Linalg::Tensor<float> input(256, 64);
+  for (size_t i = 0; i < input.size(); i++)
+    input[i] = Util::random_range<float>(-1, 1);
+
+  float sink = 0;
+  double plain = usPer(children * rounds, [&](size_t i) {
+    sink += population[i % children].forward(input)[0];
+  });
+
+  Model::PrefixCache<float> cache(input);
+  double cached = usPer(children * rounds, [&](size_t i) {
+    sink += cache.forward(population[i % children])[0];
+  });
+
+  printf("fitness forward  plain %7.2f us  prefix cache %7.2f us  "
+         "speedup %5.2fx  (%zu of %zu layer passes reused)\n",
+         plain, cached, plain / cached, cache.reused(),
+         cache.reused() + cache.computed());
+
+  if (sink == 12345)
+    printf("\n");
+
+  // The cache has to see weights written through a kept pointer once
+  // modified() is called, and every nudge costMutate makes.
+  Model::Network<float> net = parent;
+  Layer::DynamicDense<float> &top = net.layer(last);
+  Model::PrefixCache<float> check(input);
+
+  float *kept = top.m_matrix.data();
+  const float before = check.forward(net)[0];
+  kept[top.inputs() * top.outputs()] += 1;
+  top.m_matrix.modified();
+  if (check.forward(net)[0] == before) {
+    printf("PrefixCache missed a write through a kept pointer\n");
+    return 1;
+  }
+
+  Linalg::Tensor<float> targets(input.shape(0), top.outputs());
+  auto sumSq = [&](const Linalg::Tensor<float> &out) {
+    return Loss::mse(out.data(), targets.data(), out.size());
+  };
+  double nudged = 0;
+  auto cost = [&]() { return nudged = sumSq(check.forward(net)); };
+
+  size_t changed = 0;
+  for (size_t i = 0; i < 200; i++) {
+    const double current = cost();
+    Mutation::costMutate(&top.m_matrix, cost, 0.1f);
+    changed += nudged != current;
+
+    if (cost() != sumSq(net.forward(input))) {
+      printf("PrefixCache disagrees with a plain forward pass\n");
+      return 1;
+    }
+  }
+
+  printf("prefix cache  %zu of 200 nudges changed the cached cost\n", changed);
+  if (changed == 0) {
+    printf("PrefixCache never saw a nudge\n");
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,115 @@
+// Forward pass of the Dense shapes used in examples/ and bench/, for
+// input-major (RowMajor) and output-major (ColumnMajor) weights. Shapes marked
+// * default to output-major. Both layouts are checked against a plain loop
+// over the same weights first.
+
+#include "NNKek.h"
+#include <chrono>
+#include <cmath>
+
+using namespace NNKek;
+
+constexpr size_t numInputs = 64;
+constexpr size_t budget = 400000000;
+
+template <typename T, size_t INP, size_t OUT, Linalg::Order ORDER>
+double nsPerForward(const Linalg::Vector<T, INP> *inputs, T *sink) {
+  Layer::Dense<T, INP, OUT, ORDER> layer;
+  Mutation::testMutate(&layer.m_matrix, 1.0);
+
+  const size_t iterations =
+      std::min<size_t>(2000000, budget / ((INP + 1) * OUT));
+  T acc = 0;
+  auto start = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < iterations; i++) {
+    Linalg::Vector<T, OUT> out;
+    Layer::DenseKernel<T, INP, OUT, ORDER>::forward(
+        inputs[i % numInputs].data(), layer.m_matrix.data(), out.data());
+    acc += out[i % OUT];
+  }
+
+  auto end = std::chrono::steady_clock::now();
+  *sink += acc;
+  return std::chrono::duration<double, std::nano>(end - start).count() /
+         iterations;
+}
+
+// Whether both layouts give the outputs of a plain loop over the same
+// weights, up to rounding from the order of the additions.
+template <typename T, size_t INP, size_t OUT>
+bool matches(const Linalg::Vector<T, INP> *inputs) {
+  Layer::Dense<T, INP, OUT, Linalg::Order::RowMajor> rows;
+  Mutation::testMutate(&rows.m_matrix, 1.0);
+  Layer::Dense<T, INP, OUT, Linalg::Order::ColumnMajor> cols;
+  cols.m_matrix = decltype(cols.m_matrix)(rows.m_matrix);
+
+  const T *w = rows.m_matrix.data();
+  for (size_t i = 0; i < numInputs; i++) {
+    const Linalg::Vector<T, OUT> a = rows.forward(inputs[i]);
+    const Linalg::Vector<T, OUT> b = cols.forward(inputs[i]);
+
+    for (size_t o = 0; o < OUT; o++) {
+      double expected = w[INP * OUT + o];
+      double scale = std::fabs(expected);
+      for (size_t j = 0; j < INP; j++) {
+        expected += static_cast<double>(inputs[i][j]) * w[j * OUT + o];
+        scale += std::fabs(static_cast<double>(inputs[i][j]) * w[j * OUT + o]);
+      }
+
+      const double tolerance = 1e-5 * scale + 1e-6;
+      if (std::fabs(a[o] - expected) > tolerance ||
+          std::fabs(b[o] - expected) > tolerance)
+        return false;
+    }
+  }
+
+  return true;
+}
+
+template <typename T, size_t INP, size_t OUT> bool run(const char *type) {
+  constexpr auto rows = Linalg::Order::RowMajor;
+  constexpr auto cols = Linalg::Order::ColumnMajor;
+
+  static Linalg::Vector<T, INP> inputs[numInputs];
+  for (size_t i = 0; i < numInputs; i++)
+    for (size_t j = 0; j < INP; j++)
+      inputs[i][j] = Util::random_range<T>(-1, 1);
+
+  char name[64];
+  snprintf(name, sizeof(name), "Dense<%s, %zu, %zu>%s", type, INP, OUT,
+           Layer::denseOrder<T>(INP, OUT) == cols ? " *" : "");
+
+  if (!matches<T, INP, OUT>(inputs)) {
+    printf("%-24s the layouts disagree with the reference\n", name);
+    return false;
+  }
+
+  T sink = 0;
+  double rowsNs = nsPerForward<T, INP, OUT, rows>(inputs, &sink);
+  double colsNs = nsPerForward<T, INP, OUT, cols>(inputs, &sink);
+  printf("%-24s input-major %9.2f ns  output-major %9.2f ns  speedup %5.2fx\n",
+         name, rowsNs, colsNs, rowsNs / colsNs);
+
+  if (sink == 12345)
+    printf("\n");
+  return true;
+}
+
+int main(void) {
+  bool ok = true;
+  ok &= run<double, 4, 2>("double");
+  ok &= run<double, 2, 3>("double");
+  ok &= run<double, 4, 5>("double");
+  ok &= run<double, 5, 3>("double");
+  ok &= run<double, 13, 3>("double");
+  ok &= run<double, 3, 3>("double");
+  ok &= run<float, 1, 50>("float");
+  ok &= run<float, 50, 1>("float");
+  ok &= run<float, 64, 128>("float");
+  ok &= run<float, 128, 10>("float");
+  ok &= run<float, 64, 256>("float");
+  ok &= run<float, 256, 256>("float");
+  ok &= run<float, 256, 10>("float");
+  return ok ? 0 : 1;
+}
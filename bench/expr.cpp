@@ -0,0 +1,72 @@
+// (target - result).magSq() as a fused expression, against copying into a
+// temporary vector and walking it again as Vector::operator- used to.
+
+#include "NNKek.h"
+#include <chrono>
+
+using namespace NNKek;
+
+constexpr size_t numVectors = 64;
+constexpr size_t iterations = 2000000;
+
+template <typename T, size_t SIZE>
+T eagerMagSq(const Linalg::Vector<T, SIZE> &a,
+             const Linalg::Vector<T, SIZE> &b) {
+  Linalg::Vector<T, SIZE> v = a;
+  for (size_t i = 0; i < SIZE; i++)
+    v[i] -= b[i];
+
+  T sum = 0;
+  for (size_t i = 0; i < SIZE; i++)
+    sum += v[i] * v[i];
+  return sum;
+}
+
+template <typename T, size_t SIZE, typename F>
+double nsPer(const Linalg::Vector<T, SIZE> *vectors, T *sink, F f) {
+  T acc = 0;
+  auto start = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < iterations; i++)
+    acc += f(vectors[i % numVectors], vectors[(i + 1) % numVectors]);
+
+  auto end = std::chrono::steady_clock::now();
+  *sink += acc;
+  return std::chrono::duration<double, std::nano>(end - start).count() /
+         iterations;
+}
+
+template <typename T, size_t SIZE> void run(const char *type) {
+  static Linalg::Vector<T, SIZE> vectors[numVectors];
+  for (size_t i = 0; i < numVectors; i++)
+    for (size_t j = 0; j < SIZE; j++)
+      vectors[i][j] = Util::random_range<T>(-1, 1);
+
+  typedef Linalg::Vector<T, SIZE> V;
+  T sink = 0;
+  double eager = nsPer(vectors, &sink, [](const V &a, const V &b) {
+    return eagerMagSq(a, b);
+  });
+  double fused = nsPer(vectors, &sink, [](const V &a, const V &b) {
+    return (a - b).magSq();
+  });
+
+  char name[64];
+  snprintf(name, sizeof(name), "Vector<%s, %zu>", type, SIZE);
+  printf("%-20s eager %8.2f ns  fused %8.2f ns  speedup %5.2fx\n", name, eager,
+         fused, eager / fused);
+
+  if (sink == 12345)
+    printf("\n");
+}
+
+int main(void) {
+  run<double, 3>("double");
+  run<double, 4>("double");
+  run<float, 16>("float");
+  run<float, 100>("float");
+  run<float, 1000>("float");
+  run<double, 1000>("double");
+
+  return 0;
+}
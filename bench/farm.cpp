@@ -0,0 +1,89 @@
+// Scoring 4096 candidates of the 1-50-1 sine network on two local farm
+// workers: one genome per message and one message in flight, against batched
+// and pipelined messages, and the cost of losing a worker mid-run.
+
+#include "NNKek.h"
+#include <chrono>
+#include <cmath>
+#include <csignal>
+
+using namespace NNKek;
+
+typedef Layer::Dense<float, 1, 50> L1;
+typedef Layer::Dense<float, 50, 1> L2;
+
+L1 layer1;
+L2 layer2;
+Model::Genome<float> genome(&layer1, &layer2);
+
+constexpr size_t workers = 2;
+constexpr size_t candidates = 4096;
+constexpr size_t rounds = 5;
+
+double fitness(const float *params) {
+  genome.load(params);
+
+  double error = 0;
+  for (float i = -5; i < 5; i += 0.2) {
+    Linalg::Vector<float, 1> v;
+    v[0] = i / 10.0;
+    auto hidden = Activation::tanh(layer1.forward(v));
+    auto diff = std::sin(i) - Activation::tanh(layer2.forward(hidden))[0];
+    error += diff * diff;
+  }
+
+  return error;
+}
+
+void run(const char *name, size_t inFlight, size_t batchBytes, bool kill) {
+  Farm::Config config;
+  config.inFlight = inFlight;
+  config.batchBytes = batchBytes;
+  Farm::Coordinator<float> farm(genome.size(), config);
+
+  pid_t pids[workers];
+  farm.spawnLocal(workers, fitness, pids);
+  farm.waitForWorkers(workers, 5000);
+
+  Container::Vector<float> population;
+  for (size_t i = 0; i < candidates * genome.size(); i++)
+    population.push(Util::random_range<float>(-1, 1));
+  Container::Vector<double> scores;
+  for (size_t i = 0; i < candidates; i++)
+    scores.push(0);
+
+  auto start = std::chrono::steady_clock::now();
+  for (size_t r = 0; r < rounds; r++) {
+    if (kill && r == rounds / 2)
+      ::kill(pids[0], SIGKILL);
+    if (!farm.evaluate(population.data(), candidates, scores.data()))
+      printf("evaluate failed\n");
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  double seconds = std::chrono::duration<double>(end - start).count();
+  double check = fitness(population.data() + 7 * genome.size());
+  const Farm::Stats &stats = farm.stats();
+  printf("%-34s %8.0f evaluations/s  %6zu batches  %4zu requeued  %s\n",
+         name, rounds * candidates / seconds, stats.batches, stats.requeued,
+         scores[7] == check ? "ok" : "MISMATCH");
+
+  farm.shutdown();
+  for (size_t i = 0; i < workers; i++)
+    waitpid(pids[i], NULL, 0);
+}
+
+int main(void) {
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < candidates; i++)
+    fitness(genome.data());
+  const double local =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+  printf("%-34s %8.0f evaluations/s\n", "in process", candidates / local);
+
+  run("1 genome per message, 1 in flight", 1, 1, false);
+  run("batched, 4 in flight", 4, 1 << 16, false);
+  run("batched, 4 in flight, lose worker", 4, 1 << 16, true);
+  return 0;
+}
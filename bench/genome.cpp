@@ -0,0 +1,69 @@
+// Cloning and mutating a 64-256-256-10 candidate, per layer against one flat
+// Model::Genome.
+
+#include "NNKek.h"
+#include <chrono>
+
+using namespace NNKek;
+
+typedef Layer::Dense<float, 64, 256> L1;
+typedef Layer::Dense<float, 256, 256> L2;
+typedef Layer::Dense<float, 256, 10> L3;
+
+constexpr size_t iterations = 20000;
+
+template <typename F> double usPer(F f) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; i++)
+    f(i);
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::micro>(end - start).count() /
+         iterations;
+}
+
+int main(void) {
+  L1 layer1;
+  L2 layer2;
+  L3 layer3;
+  Mutation::testMutate(&layer1.m_matrix, 1.0);
+  Mutation::testMutate(&layer2.m_matrix, 1.0);
+  Mutation::testMutate(&layer3.m_matrix, 1.0);
+
+  L1 copy1;
+  L2 copy2;
+  L3 copy3;
+  double perLayer = usPer([&](size_t) {
+    copy1 = layer1;
+    copy2 = layer2;
+    copy3 = layer3;
+    Mutation::normalMutate(&copy1.m_matrix, 0.01f, 0.1f);
+    Mutation::normalMutate(&copy2.m_matrix, 0.01f, 0.1f);
+    Mutation::normalMutate(&copy3.m_matrix, 0.01f, 0.1f);
+  });
+
+  Model::Genome<float> genome(&layer1, &layer2, &layer3);
+  Linalg::Tensor<float> population(2, genome.size());
+  double flat = usPer([&](size_t i) {
+    float *child = population.row(i % 2);
+    genome.store(child);
+    Mutation::normalMutate(child, genome.size(), 0.01f, 0.1f);
+  });
+
+  double cross = usPer([&](size_t) {
+    Mutation::crossover(population.row(0), population.row(1), genome.data(),
+                        genome.size());
+  });
+
+  double blend = usPer([&](size_t) {
+    Mutation::blend(population.row(0), population.row(1), genome.data(),
+                    genome.size(), 0.5f);
+  });
+
+  printf("%zu parameters\n", genome.size());
+  printf("clone + mutate  per layer %7.2f us  genome %7.2f us  "
+         "speedup %5.2fx\n",
+         perLayer, flat, perLayer / flat);
+  printf("crossover %7.2f us  blend %7.2f us\n", cross, blend);
+
+  return 0;
+}
@@ -0,0 +1,65 @@
+// Classification cost over a batch: softmax followed by squared error against
+// one-hot targets, as the examples do it, against the fused
+// Loss::crossEntropy on the raw outputs.
+
+#include "NNKek.h"
+#include <chrono>
+
+using namespace NNKek;
+
+constexpr size_t iterations = 20000;
+
+template <typename F> double usPer(F f) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; i++)
+    f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::micro>(end - start).count() /
+         iterations;
+}
+
+template <size_t CLASSES> void run(size_t batch) {
+  typedef Linalg::Vector<float, CLASSES> V;
+  Container::Vector<V> outputs;
+  Container::Vector<V> targets;
+  Linalg::Tensor<float> logits(batch, CLASSES);
+  Container::Vector<size_t> labels;
+
+  for (size_t i = 0; i < batch; i++) {
+    V out;
+    V target;
+    for (size_t c = 0; c < CLASSES; c++)
+      out[c] = logits(i, c) = Util::random_range<float>(-4, 4);
+    labels.push(i % CLASSES);
+    target[i % CLASSES] = 1;
+    outputs.push(out);
+    targets.push(target);
+  }
+
+  double sink = 0;
+  double softmaxSq = usPer([&]() {
+    double error = 0;
+    for (size_t i = 0; i < batch; i++)
+      error += (targets[i] - Activation::softmax(outputs[i])).magSq();
+    sink += error / batch;
+  });
+
+  double fused = usPer(
+      [&]() { sink += Loss::crossEntropy(logits, labels.data()); });
+
+  printf("%4zu x %-4zu softmax + magSq %8.2f us  crossEntropy %8.2f us  "
+         "speedup %5.2fx\n",
+         batch, CLASSES, softmaxSq, fused, softmaxSq / fused);
+
+  if (sink == 12345)
+    printf("\n");
+}
+
+int main(void) {
+  run<3>(256);
+  run<10>(256);
+  run<100>(256);
+  run<1000>(16);
+
+  return 0;
+}
@@ -0,0 +1,109 @@
+// Fitness of one 64-128-10 candidate over 16384 samples: a batched
+// Network::forward and an example-style loop over Dense layers one sample at a
+// time, serial against Parallel pools of 1, 2 and 4 threads. Every parallel
+// result must match the others bit for bit.
+
+#include "NNKek.h"
+#include <chrono>
+
+using namespace NNKek;
+using Linalg::Tensor;
+
+constexpr size_t samples = 16384;
+constexpr size_t iterations = 10;
+
+template <typename F> double msPer(F f) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; i++)
+    f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count() /
+         iterations;
+}
+
+int main(void) {
+  Model::Network<float> net;
+  net.setInputs(64);
+  net.add(128, Activation::Kind::Relu);
+  net.add(10, Activation::Kind::Linear);
+  for (size_t l = 0; l < net.depth(); l++)
+    Mutation::normalMutate(&net.layer(l).m_matrix, 0.2f);
+
+  Tensor<float> inputs(samples, 64);
+  Tensor<float> targets(samples, 10);
+  for (size_t i = 0; i < inputs.size(); i++)
+    inputs[i] = Util::random_range<float>(-1, 1);
+  for (size_t i = 0; i < targets.size(); i++)
+    targets[i] = Util::random_range<float>(-1, 1);
+
+  // Layer by layer over the whole batch, as Network::forward does for small
+  // batches.
+  auto wholeBatch = [&]() {
+    auto result = Activation::apply(net.activation(0),
+                                    net.layer(0).forward(inputs));
+    return Activation::apply(net.activation(1), net.layer(1).forward(result));
+  };
+
+  Tensor<float> serial = wholeBatch();
+  Tensor<float> chunked = net.forward(inputs);
+  if (memcmp(serial.data(), chunked.data(), serial.size() * sizeof(float))) {
+    printf("chunked forward differs from the whole-batch one\n");
+    return 1;
+  }
+
+  double sink = 0;
+  double tSerial = msPer([&]() { sink += wholeBatch()[0]; });
+  double tChunked = msPer([&]() { sink += net.forward(inputs)[0]; });
+  printf("forward %zu x 64-128-10  whole batch %7.3f ms  chunked on %zu "
+         "thread%s %7.3f ms  speedup %5.2fx\n",
+         samples, tSerial, Parallel::Pool::global().threads(),
+         Parallel::Pool::global().threads() == 1 ? "" : "s", tChunked,
+         tSerial / tChunked);
+
+  Layer::Dense<float, 64, 128> layer1;
+  Layer::Dense<float, 128, 10> layer2;
+  Mutation::normalMutate(&layer1.m_matrix, 0.2f);
+  Mutation::normalMutate(&layer2.m_matrix, 0.2f);
+
+  auto error = [&](size_t i) {
+    Linalg::Vector<float, 64> x;
+    Linalg::Vector<float, 10> y;
+    memcpy(x.data(), inputs.data() + i * 64, sizeof(x));
+    memcpy(y.data(), targets.data() + i * 10, sizeof(y));
+    auto hidden = Activation::relu(layer1.forward(x));
+    return Loss::mse(layer2.forward(hidden), y);
+  };
+
+  double loop = 0;
+  double tLoop = msPer([&]() {
+    loop = 0;
+    for (size_t i = 0; i < samples; i++)
+      loop += error(i);
+  });
+  printf("per-sample loop  serial          %7.3f ms\n", tLoop);
+
+  const size_t threads[] = {1, 2, 4};
+  double first = 0;
+  for (size_t t : threads) {
+    Parallel::Pool pool(t);
+    double sum = 0;
+    double time = msPer(
+        [&]() { sum = Parallel::parallelReduce(samples, 0.0, error, pool); });
+
+    if (t == 1)
+      first = sum;
+    if (memcmp(&sum, &first, sizeof(double)) != 0) {
+      printf("parallelReduce differs between thread counts\n");
+      return 1;
+    }
+
+    printf("per-sample loop  parallelReduce %zu thread%s %7.3f ms  speedup "
+           "%5.2fx  sum %.17g\n",
+           t, t == 1 ? " " : "s", time, tLoop / time, sum);
+  }
+
+  if (sink == 12345 || loop == 12345)
+    printf("\n");
+
+  return 0;
+}
@@ -0,0 +1,64 @@
+// Forward pass and model file size of a pruned 1024x1024 layer, dense against
+// Layer::SparseDense, over a range of sparsities.
+
+#include "NNKek.h"
+#include <chrono>
+
+using namespace NNKek;
+
+constexpr size_t width = 1024;
+constexpr size_t iterations = 200;
+
+template <typename F> double usPerCall(F f) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; i++)
+    f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::micro>(end - start).count() /
+         iterations;
+}
+
+long fileSize(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL)
+    return -1;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fclose(f);
+  return size;
+}
+
+int main(void) {
+  const char *path = "bench/sparse.model.tmp";
+  const double sparsities[] = {0, 0.5, 0.8, 0.9, 0.95, 0.98};
+
+  Linalg::Tensor<float> input(width);
+  for (size_t i = 0; i < width; i++)
+    input[i] = Util::random_range<float>(-1, 1);
+
+  for (double sparsity : sparsities) {
+    Model::Network<float> net;
+    net.setInputs(width);
+    net.add(width, Activation::Kind::Linear);
+
+    Layer::DynamicDense<float> &dense = net.layer(0);
+    Mutation::testMutate(&dense.m_matrix, 1.0);
+    Prune::topK(&dense, static_cast<size_t>((1 - sparsity) * width));
+    Layer::SparseDense<float> sparse(dense);
+
+    float sink = 0;
+    double denseUs = usPerCall([&]() { sink += dense.forward(input)[0]; });
+    double sparseUs = usPerCall([&]() { sink += sparse.forward(input)[0]; });
+
+    net.save(path);
+    long bytes = fileSize(path);
+
+    printf("sparsity %4.0f%%  dense %8.2f us  sparse %8.2f us  speedup %5.2fx"
+           "  model file %8ld bytes%s\n",
+           sparse.sparsity() * 100, denseUs, sparseUs, denseUs / sparseUs,
+           bytes, sink == 12345 ? " " : "");
+  }
+
+  remove(path);
+  return 0;
+}
@@ -0,0 +1,120 @@
+// Fits sin(x) on [-5, 5] with a 1-50-1 tanh network from the same seeds,
+// once with the loop the examples used to run (costMutate per layer, then a
+// fresh fitness() for the stopping test) and once with Train::Loop. Both take
+// the same steps, so only the number of evaluations and the time differ.
+
+#include "NNKek.h"
+#include <chrono>
+#include <cmath>
+
+using namespace NNKek;
+
+typedef Layer::Dense<float, 1, 50> L1;
+typedef Layer::Dense<float, 50, 1> L2;
+
+constexpr size_t seeds = 5;
+constexpr double target = 0.01;
+
+struct Net {
+  L1 layer1;
+  L2 layer2;
+};
+
+size_t evaluations;
+
+double fitness(const Net &net) {
+  double error = 0;
+  size_t x = 0;
+  evaluations++;
+
+  for (float i = -5; i < 5; i += 0.2) {
+    Linalg::Vector<float, 1> v;
+    v[0] = i / 10.0;
+    auto hidden = Activation::tanh(net.layer1.forward(v));
+    auto result = Activation::tanh(net.layer2.forward(hidden))[0];
+    error += (std::sin(i) - result) * (std::sin(i) - result);
+    x++;
+  }
+
+  return error / x;
+}
+
+struct Result {
+  size_t iterations;
+  size_t evaluations;
+  double cost;
+  double seconds;
+};
+
+Result plain(uint64_t seed) {
+  gen.seed(seed);
+  Net net;
+  Mutation::normalMutate(&net.layer1.m_matrix, 1.0f);
+  Mutation::normalMutate(&net.layer2.m_matrix, 1.0f);
+  evaluations = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  auto cost = [&net]() { return fitness(net); };
+  double score = fitness(net);
+  size_t i = 0;
+
+  for (; score > target; i++) {
+    Mutation::costMutate(&net.layer1.m_matrix, cost, 0.1f);
+    Mutation::costMutate(&net.layer2.m_matrix, cost, 0.1f);
+    score = fitness(net);
+  }
+
+  auto end = std::chrono::steady_clock::now();
+  return Result{i, evaluations, score,
+                std::chrono::duration<double>(end - start).count()};
+}
+
+Result loop(uint64_t seed) {
+  gen.seed(seed);
+  Net net;
+  Mutation::normalMutate(&net.layer1.m_matrix, 1.0f);
+  Mutation::normalMutate(&net.layer2.m_matrix, 1.0f);
+  evaluations = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  auto cost = [&net]() { return fitness(net); };
+  Train::Config config;
+  config.targetCost = target;
+  auto loop = Train::loop<float>(cost, config);
+  loop.add(&net.layer1.m_matrix, 0.1f);
+  loop.add(&net.layer2.m_matrix, 0.1f);
+  const Train::Stats &stats = loop.run();
+
+  auto end = std::chrono::steady_clock::now();
+  return Result{stats.iterations, evaluations, stats.cost,
+                std::chrono::duration<double>(end - start).count()};
+}
+
+int main(void) {
+  double plainSeconds = 0;
+  double loopSeconds = 0;
+
+  printf("%-6s %-12s %10s %12s %10s %10s\n", "seed", "driver", "iterations",
+         "evaluations", "cost", "seconds");
+
+  for (uint64_t seed = 1; seed <= seeds; seed++) {
+    const Result a = plain(seed);
+    const Result b = loop(seed);
+    plainSeconds += a.seconds;
+    loopSeconds += b.seconds;
+
+    printf("%-6lu %-12s %10zu %12zu %10.6f %10.3f\n",
+           static_cast<unsigned long>(seed), "costMutate", a.iterations,
+           a.evaluations, a.cost, a.seconds);
+    printf("%-6s %-12s %10zu %12zu %10.6f %10.3f\n", "", "Train::Loop",
+           b.iterations, b.evaluations, b.cost, b.seconds);
+
+    if (a.iterations != b.iterations || a.cost != b.cost) {
+      printf("Train::Loop took a different path\n");
+      return 1;
+    }
+  }
+
+  printf("Speedup %.2fx\n", plainSeconds / loopSeconds);
+  return 0;
+}
@@ -76,7 +76,7 @@ int main(void) {
 
   for (size_t i = 0; i < 100; i++) {
     if (i % 1000 == 0) {
-      printf("Iteration %ld, the error is %f                      \r", i,
+      printf("Iteration %zu, the error is %f                      \r", i,
              score);
       fflush(stdout);
     }
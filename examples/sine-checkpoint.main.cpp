@@ -0,0 +1,97 @@
+#include "NNKek.h"
+#include <cmath>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace NNKek;
+using namespace NNKek::Linalg;
+
+typedef Layer::Dense<float, 1, 50> L1;
+typedef Layer::Dense<float, 50, 1> L2;
+
+float getResult(const L1 &layer1, const L2 &layer2, float input) {
+  Vector<float, 1> v;
+  v[0] = input / 10.0;
+
+  auto result = Activation::tanh(layer1.forward(v));
+  return Activation::tanh(layer2.forward(result))[0];
+}
+
+double fitness(const L1 &layer1, const L2 &layer2) {
+  double error = 0;
+  size_t x = 0;
+
+  for (float i = -5; i < 5; i += 0.2) {
+    auto diff = std::sin(i) - getResult(layer1, layer2, i);
+    error += diff * diff;
+    x++;
+  }
+
+  return error / x;
+}
+
+struct Run {
+  uint64_t iteration = 0;
+  double score = 0;
+  L1 layer1;
+  L2 layer2;
+
+  void save(Checkpoint::State *state) const {
+    state->clear();
+    state->put(iteration);
+    state->put(score);
+    state->put(gen);
+    state->putArray(layer1.m_matrix.data(), 2 * 50);
+    state->putArray(layer2.m_matrix.data(), 51 * 1);
+  }
+
+  bool load(Checkpoint::State *state) {
+    return state->get(&iteration) && state->get(&score) && state->get(&gen) &&
+           state->getArray(layer1.m_matrix.data(), 2 * 50) &&
+           state->getArray(layer2.m_matrix.data(), 51 * 1);
+  }
+};
+
+// Trains the sine network, checkpointing every 1000 iterations. Started
+// again with the same checkpoint path, it picks up where the last checkpoint
+// left off and follows exactly the path an uninterrupted run would have.
+// A non-zero limit stops the run after that many iterations in total.
+int main(int argc, char **argv) {
+  const char *path = argc > 1 ? argv[1] : "sine.ckpt";
+  const uint64_t limit = argc > 2 ? strtoull(argv[2], NULL, 10) : 0;
+
+  gen.seed(1);
+  Run run;
+  run.score = fitness(run.layer1, run.layer2);
+
+  Checkpoint::State state;
+  if (Checkpoint::load(path, &state) && run.load(&state))
+    printf("Resumed %s at iteration %lu, the error is %f\n", path,
+           static_cast<unsigned long>(run.iteration), run.score);
+
+  Checkpoint::Writer writer(path);
+
+  auto cost = [&run]() { return fitness(run.layer1, run.layer2); };
+  auto loop = Train::loop<float>(cost);
+  loop.add(&run.layer1.m_matrix, 0.1f);
+  loop.add(&run.layer2.m_matrix, 0.1f);
+
+  while (run.score > 0.01 && (limit == 0 || run.iteration < limit)) {
+    run.score = loop.step();
+    run.iteration++;
+
+    if (run.iteration % 1000 == 0) {
+      run.save(&state);
+      writer.save(state);
+    }
+  }
+
+  run.save(&state);
+  writer.save(state);
+  if (!writer.flush())
+    printf("Cannot write %s\n", path);
+
+  printf("Iteration %lu, the error is %.17g\n",
+         static_cast<unsigned long>(run.iteration), run.score);
+  return 0;
+}
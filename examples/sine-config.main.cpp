@@ -0,0 +1,48 @@
+#include "NNKek.h"
+#include <cmath>
+#include <stdio.h>
+
+using namespace NNKek;
+using namespace NNKek::Linalg;
+
+double fitness(const Model::Network<float> &net, const Tensor<float> &inputs,
+               const Tensor<float> &targets) {
+  return Loss::mse(net.forward(inputs), targets);
+}
+
+int main(int argc, char **argv) {
+  const char *path = argc > 1 ? argv[1] : "examples/sine.net";
+  auto loaded = Model::Network<float>::fromConfig(path);
+
+  if (!loaded.is_some()) {
+    printf("Cannot load %s\n", path);
+    return 1;
+  }
+
+  auto net = loaded.value();
+
+  Tensor<float> inputs(50, 1);
+  Tensor<float> targets(50, 1);
+  for (size_t i = 0; i < 50; i++) {
+    float x = -5 + i * 0.2;
+    inputs(i, 0) = x / 10.0;
+    targets(i, 0) = std::sin(x);
+  }
+
+  auto cost = [&]() { return fitness(net, inputs, targets); };
+
+  Train::Config config;
+  config.targetCost = 0.01;
+  auto loop = Train::loop<float>(cost, config);
+  for (size_t l = 0; l < net.depth(); l++)
+    loop.add(&net.layer(l).m_matrix, 0.1f);
+  loop.run();
+
+  Tensor<float> x(1);
+  for (float i = -5; i < 5; i += 0.001) {
+    x[0] = i / 10.0;
+    printf("%f\n", net.forward(x)[0]);
+  }
+
+  return 0;
+}
@@ -0,0 +1,110 @@
+#include "NNKek.h"
+#include <cmath>
+#include <csignal>
+#include <stdio.h>
+
+using namespace NNKek;
+using namespace NNKek::Linalg;
+
+typedef Layer::Dense<float, 1, 50> L1;
+typedef Layer::Dense<float, 50, 1> L2;
+
+// Every worker process gets its own copy of these.
+L1 layer1;
+L2 layer2;
+Model::Genome<float> genome(&layer1, &layer2);
+
+float getResult(float input) {
+  Vector<float, 1> v;
+  v[0] = input / 10.0;
+
+  auto result = Activation::tanh(layer1.forward(v));
+  return Activation::tanh(layer2.forward(result))[0];
+}
+
+double fitness(const float *params) {
+  genome.load(params);
+
+  double error = 0;
+  size_t x = 0;
+
+  for (float i = -5; i < 5; i += 0.2) {
+    auto diff = std::sin(i) - getResult(i);
+    error += diff * diff;
+    x++;
+  }
+
+  return error / x;
+}
+
+constexpr size_t workers = 3;
+constexpr size_t children = 64;
+
+int main(void) {
+  const size_t n = genome.size();
+  Farm::Coordinator<float> farm(n);
+  if (!farm.ok()) {
+    printf("Cannot listen\n");
+    return 1;
+  }
+
+  pid_t pids[workers];
+  farm.spawnLocal(workers, fitness, pids);
+  printf("%zu of %zu workers connected on port %u\n",
+         farm.waitForWorkers(workers, 5000), workers, farm.port());
+
+  gen.seed(1);
+  Container::Vector<float> parent;
+  for (size_t i = 0; i < n; i++)
+    parent.push(0);
+  Mutation::normalMutate(parent.data(), n, 0.5f);
+  double score = fitness(parent.data());
+
+  Container::Vector<float> population;
+  for (size_t i = 0; i < children * n; i++)
+    population.push(0);
+  double scores[children];
+  Mutation::Adaptive<float> step(0.1f);
+
+  size_t generation = 0;
+  for (; score > 0.01 && generation < 5000; generation++) {
+    // A lost worker only costs time: its candidates go to the others.
+    if (generation == 100) {
+      kill(pids[0], SIGKILL);
+      printf("Killed worker %d\n", pids[0]);
+    }
+
+    for (size_t c = 0; c < children; c++) {
+      float *child = population.data() + c * n;
+      memcpy(child, parent.data(), n * sizeof(float));
+      Mutation::normalMutate(child, n, 0.1f, step.sigma());
+    }
+
+    if (!farm.evaluate(population.data(), children, scores)) {
+      printf("No workers left\n");
+      return 1;
+    }
+
+    size_t best = 0;
+    for (size_t c = 1; c < children; c++)
+      if (scores[c] < scores[best])
+        best = c;
+
+    step.report(scores[best] < score);
+    if (scores[best] <= score) {
+      score = scores[best];
+      memcpy(parent.data(), population.data() + best * n, n * sizeof(float));
+    }
+  }
+
+  farm.shutdown();
+  for (size_t i = 0; i < workers; i++)
+    waitpid(pids[i], NULL, 0);
+
+  const Farm::Stats &stats = farm.stats();
+  printf("Generation %zu, cost %f, %zu evaluations in %zu batches, %zu "
+         "requeued after losing %zu worker(s)\n",
+         generation, score, stats.evaluated, stats.batches, stats.requeued,
+         stats.workersLost);
+  return 0;
+}
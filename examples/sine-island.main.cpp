@@ -0,0 +1,73 @@
+#include "NNKek.h"
+#include <cmath>
+#include <stdio.h>
+
+using namespace NNKek;
+using namespace NNKek::Linalg;
+
+typedef Layer::Dense<float, 1, 50> L1;
+typedef Layer::Dense<float, 50, 1> L2;
+
+// Every island process gets its own copy of these.
+L1 layer1;
+L2 layer2;
+Model::Genome<float> genome(&layer1, &layer2);
+
+float getResult(float input) {
+  Vector<float, 1> v;
+  v[0] = input / 10.0;
+
+  auto result = Activation::tanh(layer1.forward(v));
+  return Activation::tanh(layer2.forward(result))[0];
+}
+
+double fitness(const float *params) {
+  genome.load(params);
+
+  double error = 0;
+  size_t x = 0;
+
+  for (float i = -5; i < 5; i += 0.2) {
+    auto diff = std::sin(i) - getResult(i);
+    error += diff * diff;
+    x++;
+  }
+
+  return error / x;
+}
+
+int main(void) {
+  Island::Config config;
+  config.islands = 4;
+  config.population = 8;
+  config.generations = 20000;
+  config.migrationInterval = 50;
+  config.sigma = 0.05;
+  config.rate = 0.05;
+  config.targetCost = 0.01;
+  config.verbose = true;
+
+  auto init = [](float *params, std::mt19937_64 &rng) {
+    std::normal_distribution<float> normal(0, 0.5);
+    for (size_t i = 0; i < genome.size(); i++)
+      params[i] = normal(rng);
+  };
+
+  auto result = Island::run<float>(config, genome.size(), init, fitness);
+
+  if (!result.is_some()) {
+    printf("All islands failed\n");
+    return 1;
+  }
+
+  auto best = result.value();
+  printf("\nBest error %f from island %zu\n", best.cost, best.island);
+  for (size_t i = 0; i < best.islandCosts.size(); i++)
+    printf("Island %zu: %f\n", i, best.islandCosts[i]);
+
+  genome.load(best.genome.data());
+  for (float i = -5; i < 5; i += 0.5)
+    printf("%f %f\n", std::sin(i), getResult(i));
+
+  return 0;
+}
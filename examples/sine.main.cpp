@@ -36,17 +36,14 @@ int main(void) {
   Layer::Dense<float, 1, 50> layer1;
   Layer::Dense<float, 50, 1> layer2;
 
-  double score = fitness(layer1, layer2);
-
-  for (size_t i = 0; score > 0.01; i++) {
-    // printf("Iteration %ld, the error is %f\n", i, score);
-
-    auto cost = [&layer1, &layer2]() { return fitness(layer1, layer2); };
-
-    Mutation::costMutate(&layer1.m_matrix, cost, 0.1f);
-    Mutation::costMutate(&layer2.m_matrix, cost, 0.1f);
-    score = fitness(layer1, layer2);
-  }
+  auto cost = [&layer1, &layer2]() { return fitness(layer1, layer2); };
+
+  Train::Config config;
+  config.targetCost = 0.01;
+  auto loop = Train::loop<float>(cost, config);
+  loop.add(&layer1.m_matrix, 0.1f);
+  loop.add(&layer2.m_matrix, 0.1f);
+  loop.run();
 
   for (float i = -5; i < 5; i += 0.001) {
     auto result = getResult(layer1, layer2, i);
@@ -20,11 +20,13 @@ Linalg::Vector<double, 3> getResult(L1 &layer1, L2 &layer2,
   return result3;
 }
 
-template <typename L1, typename L2> double fitness(L1 &layer1, L2 &layer2) {
+// Mean squared error over samples [begin, end).
+template <typename L1, typename L2>
+double fitness(L1 &layer1, L2 &layer2, size_t begin, size_t end) {
   double error = 0;
   size_t x = 0;
 
-  for (size_t i = 0; i < numTrain; i++) {
+  for (size_t i = begin; i < end; i++) {
     auto target = samples[i].output;
     auto result = getResult(layer1, layer2, samples[i].input);
     error += (target - result).magSq();
@@ -69,21 +71,22 @@ int main(void) {
   Layer::Dense<double, 13, 3> layer1;
   Layer::Dense<double, 3, 3> layer2;
 
-  double score = fitness(layer1, layer2);
-
-  for (size_t i = 0; score > 0.15; i++) {
-    if (i % 10 == 0) {
-      printf("Iteration %ld, the error is %f                      \r", i,
-             score);
-      fflush(stdout);
-    }
-
-    auto cost = [&layer1, &layer2]() { return fitness(layer1, layer2); };
-
-    Mutation::costMutate(&layer1.m_matrix, cost, 0.001);
-    Mutation::costMutate(&layer2.m_matrix, cost, 0.001);
-    score = fitness(layer1, layer2);
-  }
+  Mutation::Adaptive<double> step1(0.001);
+  Mutation::Adaptive<double> step2(0.001);
+
+  auto cost = [&]() { return fitness(layer1, layer2, 0, numTrain); };
+  auto heldOut = [&]() {
+    return fitness(layer1, layer2, numTrain, samples.size());
+  };
+
+  Train::Config config;
+  config.targetCost = 0.15;
+  config.evaluateEvery = 100;
+  config.verbose = true;
+  auto loop = Train::loop<double>(cost, config);
+  loop.add(&layer1.m_matrix, &step1);
+  loop.add(&layer2.m_matrix, &step2);
+  loop.run(heldOut);
 
   size_t correct = 0;
   size_t incorrect = 0;
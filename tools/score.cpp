@@ -0,0 +1,567 @@
+// Offline batch scoring: streams rows through a Model::Network<float> and
+// writes one prediction per row.
+//
+//   tools/score.out MODEL [INPUT [OUTPUT]] [--format csv|f32]
+//                   [--predict argmax|probabilities|raw] [--header]
+//                   [--precision N] [--block-mb N]
+//
+// MODEL is a file written by Network::save, or a config file for
+// Network::fromConfig. INPUT and OUTPUT default to stdin and stdout, "-" also
+// means either. CSV input has one row of comma-separated inputs per line;
+// empty lines are skipped and --header skips the first line. f32 input is raw
+// host-order floats, one row after another.
+//
+// argmax writes the index of the largest output, probabilities the softmax of
+// the outputs (or the outputs themselves if the last layer is a softmax) and
+// raw the outputs, comma-separated with --precision decimals.
+//
+// Three stages overlap: a reader thread fills blocks of --block-mb MiB ending
+// on a row boundary, the main thread parses a block, runs it through one
+// batched forward pass and formats the predictions, all on
+// Parallel::Pool::global(), and a writer thread writes the formatted block out.
+// Numbers are parsed and printed by hand, as scanf and printf would otherwise
+// take most of the time.
+
+#include "NNKek.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+using namespace NNKek;
+
+typedef std::chrono::steady_clock Clock;
+
+enum class Format { Csv, F32 };
+
+enum class Predict { Argmax, Probabilities, Raw };
+
+struct Options {
+  Format format = Format::Csv;
+  Predict predict = Predict::Argmax;
+  bool header = false;
+  int precision = 6;
+  size_t blockBytes = 8 << 20;
+};
+
+// A bounded queue between two stages. close() lets pop() drain what is left
+// and then return false.
+template <typename T> class Queue {
+public:
+  explicit Queue(size_t capacity) : m_capacity(capacity) {}
+
+  void push(T value) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_changed.wait(lock, [&]() { return m_items.size() < m_capacity; });
+    m_items.push_back(std::move(value));
+    m_changed.notify_all();
+  }
+
+  bool pop(T *value) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_changed.wait(lock, [&]() { return !m_items.empty() || m_closed; });
+    if (m_items.empty())
+      return false;
+
+    *value = std::move(m_items.front());
+    m_items.pop_front();
+    m_changed.notify_all();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_closed = true;
+    m_changed.notify_all();
+  }
+
+private:
+  size_t m_capacity;
+  std::deque<T> m_items;
+  bool m_closed = false;
+  std::mutex m_mutex;
+  std::condition_variable m_changed;
+};
+
+struct InputBlock {
+  std::vector<char> bytes;
+  // Line number of the first byte, for error messages.
+  size_t line = 0;
+};
+
+// Formatted predictions, one piece per formatting task, written in order.
+typedef std::vector<std::vector<char>> OutputBlock;
+
+static const double powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                1e18, 1e19, 1e20, 1e21, 1e22};
+
+static double pow10(int e) {
+  if (e >= 0 && e <= 22)
+    return powers[e];
+  if (e < 0 && e >= -22)
+    return 1 / powers[-e];
+  return std::pow(10.0, e);
+}
+
+// Parses a decimal number such as -1.25e-3 from [p, end). Returns the
+// position after it, or NULL if there is no number there.
+static const char *parseFloat(const char *p, const char *end, float *out) {
+  const char *start = p;
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+'))
+    negative = *p++ == '-';
+
+  uint64_t mantissa = 0;
+  int exponent = 0;
+  int digits = 0;
+  bool any = false;
+
+  for (; p < end && *p >= '0' && *p <= '9'; p++, any = true) {
+    if (digits < 19) {
+      mantissa = mantissa * 10 + (*p - '0');
+      digits += mantissa != 0;
+    } else {
+      exponent++;
+    }
+  }
+
+  if (p < end && *p == '.') {
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++, any = true) {
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (*p - '0');
+        digits += mantissa != 0;
+        exponent--;
+      }
+    }
+  }
+
+  if (!any) {
+    // nan, inf and the like.
+    char text[32];
+    size_t n = 0;
+    for (p = start; p < end && n + 1 < sizeof(text) && *p != ',' &&
+                    *p != '\n' && *p != '\r';
+         p++)
+      text[n++] = *p;
+    text[n] = 0;
+
+    char *stop;
+    *out = strtof(text, &stop);
+    return stop == text ? NULL : start + (stop - text);
+  }
+
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    const char *q = p + 1;
+    bool negativeExp = false;
+    if (q < end && (*q == '-' || *q == '+'))
+      negativeExp = *q++ == '-';
+
+    int e = 0;
+    const char *digitsStart = q;
+    for (; q < end && *q >= '0' && *q <= '9'; q++)
+      e = Util::min(e * 10 + (*q - '0'), 100000);
+
+    if (q != digitsStart) {
+      exponent += negativeExp ? -e : e;
+      p = q;
+    }
+  }
+
+  const double value = mantissa * pow10(exponent);
+  *out = negative ? -value : value;
+  return p;
+}
+
+// Parses one CSV line of exactly n numbers into row.
+static bool parseRow(const char *p, const char *end, float *row, size_t n) {
+  for (size_t j = 0; j < n; j++) {
+    while (p < end && (*p == ' ' || *p == '\t'))
+      p++;
+
+    p = parseFloat(p, end, &row[j]);
+    if (p == NULL)
+      return false;
+
+    while (p < end && (*p == ' ' || *p == '\t'))
+      p++;
+
+    if (j + 1 < n) {
+      if (p == end || *p != ',')
+        return false;
+      p++;
+    }
+  }
+
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+    p++;
+
+  return p == end;
+}
+
+static char *formatUnsigned(char *p, uint64_t v) {
+  char digits[20];
+  size_t n = 0;
+  do {
+    digits[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v != 0);
+
+  while (n > 0)
+    *p++ = digits[--n];
+  return p;
+}
+
+// Writes v with precision decimals. Needs at most 32 bytes.
+static char *formatFixed(char *p, float v, int precision) {
+  const double scale = powers[precision];
+
+  if (!(std::fabs(v) < 1e9))
+    return p + snprintf(p, 32, "%g", v);
+
+  const uint64_t scaled = std::llround(std::fabs(v) * scale);
+  if (v < 0 && scaled != 0)
+    *p++ = '-';
+
+  p = formatUnsigned(p, scaled / static_cast<uint64_t>(scale));
+  if (precision == 0)
+    return p;
+
+  *p++ = '.';
+  uint64_t fraction = scaled % static_cast<uint64_t>(scale);
+  for (int i = precision - 1; i >= 0; i--) {
+    p[i] = '0' + fraction % 10;
+    fraction /= 10;
+  }
+  return p + precision;
+}
+
+class Scorer {
+public:
+  Scorer(const Model::Network<float> &net, const Options &options)
+      : m_net(net), m_options(options) {}
+
+  // Formats the predictions for a block. Returns false on a malformed row,
+  // after printing where it is.
+  bool score(InputBlock &block, OutputBlock *out) {
+    const size_t inputs = m_net.inputs();
+    size_t rows;
+
+    if (m_options.format == Format::F32) {
+      rows = block.bytes.size() / (inputs * sizeof(float));
+      m_input = Linalg::Tensor<float>(rows, inputs);
+      memcpy(m_input.data(), block.bytes.data(), block.bytes.size());
+    } else {
+      splitLines(block);
+      rows = m_lines.size();
+      m_input = Linalg::Tensor<float>(rows, inputs);
+      if (!parse(block))
+        return false;
+    }
+
+    if (rows == 0)
+      return true;
+
+    m_output = m_net.forward(m_input);
+    format(rows, out);
+    return true;
+  }
+
+  size_t rows() const { return m_rows; }
+
+private:
+  static constexpr size_t grain = 4096;
+
+  struct Line {
+    size_t begin;
+    size_t end;
+    size_t number;
+  };
+
+  void splitLines(const InputBlock &block) {
+    m_lines.clear();
+    const char *data = block.bytes.data();
+    const size_t size = block.bytes.size();
+    size_t line = block.line;
+
+    for (size_t begin = 0; begin < size; line++) {
+      const char *nl = static_cast<const char *>(
+          memchr(data + begin, '\n', size - begin));
+      size_t end = nl == NULL ? size : nl - data;
+
+      const bool header = m_options.header && line == 1;
+      if (!header && end > begin && !(end == begin + 1 && data[begin] == '\r'))
+        m_lines.push_back(Line{begin, end, line});
+
+      begin = end + 1;
+    }
+  }
+
+  bool parse(const InputBlock &block) {
+    const size_t inputs = m_net.inputs();
+    const char *data = block.bytes.data();
+    float *values = m_input.data();
+    std::atomic<size_t> bad(SIZE_MAX);
+
+    Parallel::parallelFor(m_lines.size(), grain, [&](size_t b, size_t e) {
+      for (size_t i = b; i < e; i++) {
+        const Line &line = m_lines[i];
+        if (!parseRow(data + line.begin, data + line.end, values + i * inputs,
+                      inputs)) {
+          size_t seen = bad.load();
+          while (i < seen && !bad.compare_exchange_weak(seen, i))
+            ;
+          return;
+        }
+      }
+    });
+
+    if (bad.load() != SIZE_MAX) {
+      fprintf(stderr, "line %zu: expected %zu comma-separated numbers\n",
+              m_lines[bad.load()].number, inputs);
+      return false;
+    }
+
+    return true;
+  }
+
+  void format(size_t rows, OutputBlock *out) {
+    const size_t outputs = m_net.outputs();
+    const size_t depth = m_net.depth();
+    const bool softmax =
+        m_options.predict == Predict::Probabilities &&
+        m_net.activation(depth - 1) != Activation::Kind::Softmax;
+    const size_t perRow = m_options.predict == Predict::Argmax
+                              ? 21
+                              : outputs * (32 + 1) + 1;
+    const float *values = m_output.data();
+
+    out->assign((rows + grain - 1) / grain, std::vector<char>());
+    Parallel::parallelFor(rows, grain, [&](size_t b, size_t e) {
+      std::vector<char> &text = (*out)[b / grain];
+      text.resize((e - b) * perRow);
+      float *probabilities = Parallel::scratch<float>(outputs);
+      char *p = text.data();
+
+      for (size_t i = b; i < e; i++) {
+        const float *row = values + i * outputs;
+
+        if (m_options.predict == Predict::Argmax) {
+          p = formatUnsigned(p, Loss::argmax(row, outputs));
+        } else {
+          if (softmax) {
+            Simd::softmax(row, probabilities, outputs);
+            row = probabilities;
+          }
+
+          for (size_t j = 0; j < outputs; j++) {
+            if (j > 0)
+              *p++ = ',';
+            p = formatFixed(p, row[j], m_options.precision);
+          }
+        }
+
+        *p++ = '\n';
+      }
+
+      text.resize(p - text.data());
+    });
+
+    m_rows += rows;
+  }
+
+  const Model::Network<float> &m_net;
+  const Options &m_options;
+  std::vector<Line> m_lines;
+  Linalg::Tensor<float> m_input;
+  Linalg::Tensor<float> m_output;
+  size_t m_rows = 0;
+};
+
+// Reads blocks that end on a row boundary: a newline for CSV, a whole number
+// of rows for f32. The remainder is carried over to the next block.
+static void readBlocks(FILE *in, const Options &options, size_t rowBytes,
+                       Queue<InputBlock> *queue, size_t *bytesRead) {
+  std::vector<char> carry;
+  size_t line = 1;
+
+  while (true) {
+    InputBlock block;
+    block.line = line;
+    block.bytes.resize(carry.size() + options.blockBytes);
+    memcpy(block.bytes.data(), carry.data(), carry.size());
+
+    const size_t got = fread(block.bytes.data() + carry.size(), 1,
+                             options.blockBytes, in);
+    *bytesRead += got;
+    const size_t size = carry.size() + got;
+    const bool last = got < options.blockBytes;
+
+    size_t cut = size;
+    if (!last && options.format == Format::Csv) {
+      const char *data = block.bytes.data();
+      while (cut > 0 && data[cut - 1] != '\n')
+        cut--;
+    } else if (options.format == Format::F32) {
+      cut = size - size % rowBytes;
+      if (last && cut != size)
+        fprintf(stderr, "ignoring %zu trailing bytes\n", size - cut);
+    }
+
+    carry.assign(block.bytes.begin() + cut, block.bytes.begin() + size);
+    block.bytes.resize(cut);
+
+    if (options.format == Format::Csv)
+      line += std::count(block.bytes.begin(), block.bytes.end(), '\n');
+
+    if (!block.bytes.empty())
+      queue->push(std::move(block));
+
+    if (last)
+      break;
+  }
+
+  queue->close();
+}
+
+static void writeBlocks(FILE *out, Queue<OutputBlock> *queue,
+                        size_t *bytesWritten, bool *ok) {
+  OutputBlock block;
+  while (queue->pop(&block)) {
+    for (const auto &piece : block) {
+      if (*ok && fwrite(piece.data(), 1, piece.size(), out) != piece.size())
+        *ok = false;
+      *bytesWritten += piece.size();
+    }
+  }
+
+  if (fflush(out) != 0)
+    *ok = false;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "Usage: score.out MODEL [INPUT [OUTPUT]] [--format csv|f32]\n"
+          "                 [--predict argmax|probabilities|raw] [--header]\n"
+          "                 [--precision N] [--block-mb N]\n");
+}
+
+int main(int argc, char **argv) {
+  Options options;
+  const char *paths[3] = {NULL, "-", "-"};
+  size_t positional = 0;
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : "";
+
+    if (strcmp(arg, "--header") == 0) {
+      options.header = true;
+    } else if (strcmp(arg, "--format") == 0 && strcmp(value, "csv") == 0) {
+      options.format = Format::Csv;
+      i++;
+    } else if (strcmp(arg, "--format") == 0 && strcmp(value, "f32") == 0) {
+      options.format = Format::F32;
+      i++;
+    } else if (strcmp(arg, "--predict") == 0 &&
+               strcmp(value, "argmax") == 0) {
+      options.predict = Predict::Argmax;
+      i++;
+    } else if (strcmp(arg, "--predict") == 0 &&
+               strcmp(value, "probabilities") == 0) {
+      options.predict = Predict::Probabilities;
+      i++;
+    } else if (strcmp(arg, "--predict") == 0 && strcmp(value, "raw") == 0) {
+      options.predict = Predict::Raw;
+      i++;
+    } else if (strcmp(arg, "--precision") == 0 && atoi(value) >= 0 &&
+               atoi(value) <= 9) {
+      options.precision = atoi(value);
+      i++;
+    } else if (strcmp(arg, "--block-mb") == 0 && atol(value) > 0) {
+      options.blockBytes = static_cast<size_t>(atol(value)) << 20;
+      i++;
+    } else if (strncmp(arg, "--", 2) != 0 && positional < 3) {
+      paths[positional++] = arg;
+    } else {
+      usage();
+      return 1;
+    }
+  }
+
+  if (positional == 0) {
+    usage();
+    return 1;
+  }
+
+  auto loaded = Model::Network<float>::load(paths[0]);
+  if (!loaded.is_some())
+    loaded = Model::Network<float>::fromConfig(paths[0]);
+  if (!loaded.is_some()) {
+    fprintf(stderr, "Cannot load %s\n", paths[0]);
+    return 1;
+  }
+
+  const Model::Network<float> net = loaded.value();
+  if (net.depth() == 0) {
+    fprintf(stderr, "%s has no layers\n", paths[0]);
+    return 1;
+  }
+
+  FILE *in = strcmp(paths[1], "-") == 0 ? stdin : fopen(paths[1], "rb");
+  FILE *out = strcmp(paths[2], "-") == 0 ? stdout : fopen(paths[2], "wb");
+  if (in == NULL || out == NULL) {
+    fprintf(stderr, "Cannot open %s\n", in == NULL ? paths[1] : paths[2]);
+    return 1;
+  }
+  setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+  const auto start = Clock::now();
+  Queue<InputBlock> inputs(2);
+  Queue<OutputBlock> outputs(2);
+  size_t bytesRead = 0;
+  size_t bytesWritten = 0;
+  bool written = true;
+
+  std::thread reader(readBlocks, in, std::cref(options),
+                     net.inputs() * sizeof(float), &inputs, &bytesRead);
+  std::thread writer(writeBlocks, out, &outputs, &bytesWritten, &written);
+
+  Scorer scorer(net, options);
+  bool parsed = true;
+  InputBlock block;
+  while (inputs.pop(&block)) {
+    OutputBlock text;
+    if (parsed && (parsed = scorer.score(block, &text)))
+      outputs.push(std::move(text));
+  }
+
+  outputs.close();
+  reader.join();
+  writer.join();
+
+  if (in != stdin)
+    fclose(in);
+  if (out != stdout && fclose(out) != 0)
+    written = false;
+
+  if (!parsed)
+    return 1;
+  if (!written) {
+    fprintf(stderr, "Cannot write %s\n", paths[2]);
+    return 1;
+  }
+
+  const double seconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  fprintf(stderr,
+          "scored %zu rows in %.3f s: %.0f rows/s, %.1f MB/s in, "
+          "%.1f MB/s out\n",
+          scorer.rows(), seconds, scorer.rows() / seconds,
+          bytesRead / seconds / 1e6, bytesWritten / seconds / 1e6);
+  return 0;
+}
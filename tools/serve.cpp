@@ -0,0 +1,620 @@
+// Dynamic-batching inference server for Model::Network<float>.
+//
+//   tools/serve.out MODEL ADDRESS [--max-batch N] [--max-delay-us N]
+//                   [--workers N] [--report-s N]
+//   tools/serve.out --load ADDRESS [--inputs N] [--clients N]
+//                   [--requests N] [--pipeline N]
+//
+// MODEL is a file written by Network::save, or a config file for
+// Network::fromConfig, which is handy for load tests. ADDRESS is unix:PATH,
+// tcp:PORT or tcp:HOST:PORT.
+//
+// Requests are queued as they arrive. A worker takes up to --max-batch of
+// them at once, but waits at most --max-delay-us after the oldest one arrived
+// for the batch to fill, then runs the whole batch through one forward pass.
+// Every --report-s seconds the server prints p50/p99 latency from the moment
+// a request was read to the moment its response was written, the throughput
+// and the mean batch size.
+//
+// --load runs a client instead: --clients connections, each keeping
+// --pipeline requests of --inputs random values in flight, and prints the
+// round-trip latency and throughput once all --requests per client are done.
+//
+// Wire format, in host byte order: a request is a uint32 id, a uint32 count
+// and count floats. The response carries the same id, the output count and
+// the outputs. A request with the wrong number of inputs gets a count of 0,
+// and the connection is closed without reading its values.
+
+#include "NNKek.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <memory>
+#include <mutex>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace NNKek;
+
+typedef std::chrono::steady_clock Clock;
+
+static std::atomic<bool> interrupted(false);
+
+static void onSignal(int) { interrupted = true; }
+
+struct Address {
+  bool isUnix = false;
+  Container::String path = Container::String("", 0);
+  Container::String host = Container::String("", 0);
+  Container::String port = Container::String("", 0);
+};
+
+static bool parseAddress(const char *text, Address *address) {
+  const size_t length = strlen(text);
+  if (strncmp(text, "unix:", 5) == 0 && length > 5) {
+    address->isUnix = true;
+    address->path = Container::String(text + 5, length - 5);
+    return address->path.length() < sizeof(sockaddr_un::sun_path);
+  }
+
+  if (strncmp(text, "tcp:", 4) != 0 || length == 4)
+    return false;
+
+  address->isUnix = false;
+  const char *rest = text + 4;
+  const char *colon = strrchr(rest, ':');
+  if (colon == NULL) {
+    address->host = Container::String("", 0);
+    address->port = Container::String(rest, strlen(rest));
+  } else {
+    address->host = Container::String(rest, colon - rest);
+    address->port = Container::String(colon + 1, strlen(colon + 1));
+  }
+  return true;
+}
+
+// Returns a listening (server) or connected (client) socket, or -1.
+static int openSocket(const Address &address, bool server) {
+  if (address.isUnix) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, address.path.c_str());
+
+    if (server)
+      unlink(address.path.c_str());
+
+    auto *p = reinterpret_cast<sockaddr *>(&sa);
+    if (fd < 0 || (server ? bind(fd, p, sizeof(sa)) != 0 || listen(fd, 128) != 0
+                          : connect(fd, p, sizeof(sa)) != 0)) {
+      if (fd >= 0)
+        close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = server ? AI_PASSIVE : 0;
+
+  addrinfo *info = NULL;
+  const char *host = address.host.length() == 0 ? NULL : address.host.c_str();
+  if (getaddrinfo(host, address.port.c_str(), &hints, &info) != 0)
+    return -1;
+
+  int fd = -1;
+  for (addrinfo *ai = info; ai != NULL && fd < 0; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0)
+      continue;
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (server ? bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 ||
+                     listen(fd, 128) != 0
+               : connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  freeaddrinfo(info);
+  return fd;
+}
+
+// Largest output count the load client accepts in a response.
+static constexpr uint32_t maxCount = 1 << 20;
+
+static double percentile(const Container::Vector<double> &sorted, double p) {
+  if (sorted.size() == 0)
+    return 0;
+  return sorted[static_cast<size_t>(p * (sorted.size() - 1) + 0.5)];
+}
+
+struct Connection {
+  explicit Connection(int fd) : fd(fd), done(false) {}
+
+  ~Connection() { close(fd); }
+
+  int fd;
+  std::mutex writeMutex;
+  std::atomic<bool> done;
+  std::thread reader;
+};
+
+// Copies share the connection and the values of the input.
+struct Request {
+  std::shared_ptr<Connection> connection;
+  uint32_t id;
+  Clock::time_point arrival;
+  Linalg::Tensor<float> input;
+};
+
+struct Options {
+  size_t maxBatch = 32;
+  long maxDelayUs = 500;
+  size_t workers = 0;
+  long reportS = 5;
+};
+
+class Server {
+public:
+  Server(const Model::Network<float> &net, const Options &options)
+      : m_net(net), m_options(options) {}
+
+  Server(const Server &) = delete;
+  Server &operator=(const Server &) = delete;
+
+  ~Server() { delete[] m_workers; }
+
+  int run(int listener) {
+    m_workers = new std::thread[m_options.workers];
+    for (size_t i = 0; i < m_options.workers; i++)
+      m_workers[i] = std::thread([this]() { work(); });
+
+    Container::Vector<std::shared_ptr<Connection>> connections;
+    Clock::time_point lastReport = Clock::now();
+
+    while (!interrupted) {
+      pollfd pfd = {listener, POLLIN, 0};
+      if (poll(&pfd, 1, 200) > 0 && (pfd.revents & POLLIN)) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd >= 0) {
+          int one = 1;
+          setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+          auto connection = std::make_shared<Connection>(fd);
+          connection->reader =
+              std::thread([this, connection]() { read(connection); });
+          connections.push(connection);
+        }
+      }
+
+      // Walk backwards so that dropping a connection keeps the indices valid.
+      for (size_t i = connections.size(); i > 0; i--) {
+        if (connections[i - 1]->done) {
+          connections[i - 1]->reader.join();
+          Util::swap(connections[i - 1], connections[connections.size() - 1]);
+          connections.pop();
+        }
+      }
+
+      const auto reportEvery = std::chrono::seconds(m_options.reportS);
+      if (Clock::now() - lastReport >= reportEvery) {
+        report(Clock::now() - lastReport);
+        lastReport = Clock::now();
+      }
+    }
+
+    close(listener);
+    for (size_t i = 0; i < connections.size(); i++) {
+      shutdown(connections[i]->fd, SHUT_RD);
+      connections[i]->reader.join();
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(m_queueMutex);
+      m_stopping = true;
+    }
+    m_ready.notify_all();
+    for (size_t i = 0; i < m_options.workers; i++)
+      m_workers[i].join();
+
+    report(Clock::now() - lastReport);
+    return 0;
+  }
+
+private:
+  void read(std::shared_ptr<Connection> connection) {
+    const size_t inputs = m_net.inputs();
+    uint32_t header[2];
+
+    while (Farm::recvAll(connection->fd, header, sizeof(header))) {
+      Request request;
+      request.connection = connection;
+      request.id = header[0];
+
+      // The count comes from the client, so nothing is allocated or read
+      // before it is known to be right.
+      if (header[1] != inputs) {
+        header[1] = 0;
+        std::lock_guard<std::mutex> lock(connection->writeMutex);
+        Farm::sendAll(connection->fd, header, sizeof(header));
+        break;
+      }
+
+      request.input = Linalg::Tensor<float>(inputs);
+      if (!Farm::recvAll(connection->fd, request.input.data(),
+                         inputs * sizeof(float)))
+        break;
+
+      request.arrival = Clock::now();
+
+      size_t queued;
+      {
+        std::lock_guard<std::mutex> lock(m_queueMutex);
+        m_queue.push(request);
+        queued = m_queue.size() - m_queueHead;
+      }
+
+      // A single request only needs a worker to start its deadline; a full
+      // batch can go right away.
+      if (queued == 1 || queued >= m_options.maxBatch)
+        m_ready.notify_all();
+    }
+
+    connection->done = true;
+  }
+
+  void work() {
+    const auto maxDelay = std::chrono::microseconds(m_options.maxDelayUs);
+    std::unique_lock<std::mutex> lock(m_queueMutex);
+
+    for (;;) {
+      m_ready.wait(lock, [&]() { return m_stopping || queued() > 0; });
+      if (queued() == 0)
+        return;
+
+      m_ready.wait_until(lock, m_queue[m_queueHead].arrival + maxDelay, [&]() {
+        return m_stopping || queued() >= m_options.maxBatch;
+      });
+
+      // Another worker may have taken the batch while this one waited.
+      if (queued() == 0)
+        continue;
+
+      Container::Vector<Request> batch = take(m_options.maxBatch);
+      lock.unlock();
+      forward(batch);
+      lock.lock();
+    }
+  }
+
+  size_t queued() const { return m_queue.size() - m_queueHead; }
+
+  // Takes up to n of the oldest requests. The queue is read from m_queueHead
+  // and compacted once the part already taken outweighs the rest.
+  Container::Vector<Request> take(size_t n) {
+    Container::Vector<Request> batch;
+    n = Util::min(n, queued());
+    for (size_t i = 0; i < n; i++)
+      batch.push(m_queue[m_queueHead + i]);
+    m_queueHead += n;
+
+    if (m_queueHead * 2 >= m_queue.size()) {
+      Container::Vector<Request> rest;
+      for (size_t i = m_queueHead; i < m_queue.size(); i++)
+        rest.push(m_queue[i]);
+      m_queue = rest;
+      m_queueHead = 0;
+    }
+
+    return batch;
+  }
+
+  void forward(const Container::Vector<Request> &batch) {
+    const size_t inputs = m_net.inputs();
+    const size_t outputs = m_net.outputs();
+
+    Linalg::Tensor<float> input(batch.size(), inputs);
+    for (size_t i = 0; i < batch.size(); i++)
+      memcpy(input.data() + i * inputs, batch[i].input.data(),
+             inputs * sizeof(float));
+
+    auto output = m_net.forward(input);
+
+    const size_t bytes = 2 * sizeof(uint32_t) + outputs * sizeof(float);
+    Farm::Buffer buffer;
+    char *message = buffer.resize(bytes);
+    Container::Vector<double> latencies;
+
+    // Without memory for the replies the clients learn of it by the
+    // connection closing rather than by waiting forever.
+    if (message == NULL) {
+      for (size_t i = 0; i < batch.size(); i++)
+        shutdown(batch[i].connection->fd, SHUT_RDWR);
+      return;
+    }
+
+    for (size_t i = 0; i < batch.size(); i++) {
+      const uint32_t header[2] = {batch[i].id, static_cast<uint32_t>(outputs)};
+      memcpy(message, header, sizeof(header));
+      memcpy(message + sizeof(header), output.data() + i * outputs,
+             outputs * sizeof(float));
+
+      Connection &connection = *batch[i].connection;
+      {
+        std::lock_guard<std::mutex> lock(connection.writeMutex);
+        Farm::sendAll(connection.fd, message, bytes);
+      }
+
+      std::chrono::duration<double, std::micro> latency =
+          Clock::now() - batch[i].arrival;
+      latencies.push(latency.count());
+    }
+
+    std::lock_guard<std::mutex> lock(m_statsMutex);
+    for (size_t i = 0; i < latencies.size(); i++)
+      m_latencies.push(latencies[i]);
+    m_batches++;
+  }
+
+  void report(Clock::duration elapsed) {
+    Container::Vector<double> latencies;
+    size_t batches;
+    {
+      std::lock_guard<std::mutex> lock(m_statsMutex);
+      latencies = m_latencies;
+      m_latencies = Container::Vector<double>();
+      batches = m_batches;
+      m_batches = 0;
+    }
+
+    if (latencies.size() == 0)
+      return;
+
+    std::sort(latencies.data(), latencies.data() + latencies.size());
+    const double seconds = std::chrono::duration<double>(elapsed).count();
+    printf("%zu requests, %.0f req/s, mean batch %.1f, p50 %.0f us, "
+           "p99 %.0f us\n",
+           latencies.size(), latencies.size() / seconds,
+           static_cast<double>(latencies.size()) / batches,
+           percentile(latencies, 0.5), percentile(latencies, 0.99));
+    fflush(stdout);
+  }
+
+  const Model::Network<float> &m_net;
+  Options m_options;
+
+  std::mutex m_queueMutex;
+  std::condition_variable m_ready;
+  Container::Vector<Request> m_queue;
+  size_t m_queueHead = 0;
+  bool m_stopping = false;
+  std::thread *m_workers = NULL;
+
+  std::mutex m_statsMutex;
+  Container::Vector<double> m_latencies;
+  size_t m_batches = 0;
+};
+
+struct LoadOptions {
+  size_t inputs = 1;
+  size_t clients = 8;
+  size_t requests = 10000;
+  size_t pipeline = 1;
+};
+
+// One client connection. Appends the round-trip latency of every request to
+// latencies and returns false if the connection failed.
+static bool loadClient(const Address &address, const LoadOptions &options,
+                       uint32_t seed, Container::Vector<double> *latencies) {
+  int fd = openSocket(address, false);
+  if (fd < 0)
+    return false;
+
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> value(-1, 1);
+  Container::Vector<Clock::time_point> sent;
+  for (size_t i = 0; i < options.requests; i++)
+    sent.push(Clock::time_point());
+
+  const size_t bytes = 2 * sizeof(uint32_t) + options.inputs * sizeof(float);
+  Farm::Buffer buffer;
+  Farm::Buffer output;
+  char *message = buffer.resize(bytes);
+  if (message == NULL) {
+    close(fd);
+    return false;
+  }
+
+  auto submit = [&](uint32_t id) {
+    const uint32_t header[2] = {id, static_cast<uint32_t>(options.inputs)};
+    memcpy(message, header, sizeof(header));
+    float *values = reinterpret_cast<float *>(message + sizeof(header));
+    for (size_t i = 0; i < options.inputs; i++)
+      values[i] = value(rng);
+
+    sent[id] = Clock::now();
+    return Farm::sendAll(fd, message, bytes);
+  };
+
+  size_t next = 0;
+  bool ok = true;
+  for (; next < Util::min(options.pipeline, options.requests) && ok; next++)
+    ok = submit(next);
+
+  for (size_t received = 0; received < options.requests && ok; received++) {
+    uint32_t header[2];
+    ok = Farm::recvAll(fd, header, sizeof(header)) &&
+         header[0] < sent.size() && header[1] > 0 && header[1] <= maxCount;
+    if (!ok)
+      break;
+
+    char *values = output.resize(header[1] * sizeof(float));
+    ok = values != NULL &&
+         Farm::recvAll(fd, values, header[1] * sizeof(float));
+
+    std::chrono::duration<double, std::micro> latency =
+        Clock::now() - sent[header[0]];
+    latencies->push(latency.count());
+
+    if (ok && next < options.requests)
+      ok = submit(next++);
+  }
+
+  close(fd);
+  return ok;
+}
+
+static int runLoad(const Address &address, const LoadOptions &options) {
+  Container::Vector<Container::Vector<double>> latencies;
+  for (size_t c = 0; c < options.clients; c++)
+    latencies.push(Container::Vector<double>());
+  std::thread *clients = new std::thread[options.clients];
+  std::atomic<size_t> failed(0);
+
+  const Clock::time_point start = Clock::now();
+  for (size_t c = 0; c < options.clients; c++)
+    clients[c] = std::thread([&, c]() {
+      if (!loadClient(address, options, c + 1, &latencies[c]))
+        failed++;
+    });
+  for (size_t c = 0; c < options.clients; c++)
+    clients[c].join();
+  delete[] clients;
+  const double seconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+
+  Container::Vector<double> all;
+  for (size_t c = 0; c < options.clients; c++)
+    for (size_t i = 0; i < latencies[c].size(); i++)
+      all.push(latencies[c][i]);
+  std::sort(all.data(), all.data() + all.size());
+
+  printf("%zu requests in %.2f s, %.0f req/s, p50 %.0f us, p99 %.0f us, "
+         "max %.0f us\n",
+         all.size(), seconds, all.size() / seconds, percentile(all, 0.5),
+         percentile(all, 0.99), all.size() == 0 ? 0 : all[all.size() - 1]);
+
+  if (failed > 0) {
+    printf("%zu of %zu clients failed\n", failed.load(), options.clients);
+    return 1;
+  }
+
+  return 0;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: serve.out MODEL ADDRESS [--max-batch N] [--max-delay-us N]"
+          " [--workers N] [--report-s N]\n"
+          "       serve.out --load ADDRESS [--inputs N] [--clients N]"
+          " [--requests N] [--pipeline N]\n"
+          "ADDRESS is unix:PATH, tcp:PORT or tcp:HOST:PORT\n");
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    usage();
+    return 1;
+  }
+
+  const bool load = strcmp(argv[1], "--load") == 0;
+  Address address;
+  if (!parseAddress(argv[2], &address)) {
+    usage();
+    return 1;
+  }
+
+  Options options;
+  options.workers = Util::max<size_t>(std::thread::hardware_concurrency(), 1);
+  LoadOptions loadOptions;
+
+  for (int i = 3; i + 1 < argc; i += 2) {
+    const char *flag = argv[i];
+    const long value = atol(argv[i + 1]);
+
+    if (value <= 0) {
+      usage();
+      return 1;
+    }
+
+    if (strcmp(flag, "--max-batch") == 0 && !load)
+      options.maxBatch = value;
+    else if (strcmp(flag, "--max-delay-us") == 0 && !load)
+      options.maxDelayUs = value;
+    else if (strcmp(flag, "--workers") == 0 && !load)
+      options.workers = value;
+    else if (strcmp(flag, "--report-s") == 0 && !load)
+      options.reportS = value;
+    else if (strcmp(flag, "--inputs") == 0 && load)
+      loadOptions.inputs = value;
+    else if (strcmp(flag, "--clients") == 0 && load)
+      loadOptions.clients = value;
+    else if (strcmp(flag, "--requests") == 0 && load)
+      loadOptions.requests = value;
+    else if (strcmp(flag, "--pipeline") == 0 && load)
+      loadOptions.pipeline = value;
+    else {
+      usage();
+      return 1;
+    }
+  }
+
+  if (argc % 2 == 0) {
+    usage();
+    return 1;
+  }
+
+  if (load)
+    return runLoad(address, loadOptions);
+
+  auto loaded = Model::Network<float>::load(argv[1]);
+  if (!loaded.is_some())
+    loaded = Model::Network<float>::fromConfig(argv[1]);
+  if (!loaded.is_some()) {
+    fprintf(stderr, "Cannot load %s\n", argv[1]);
+    return 1;
+  }
+
+  auto net = loaded.value();
+
+  int listener = openSocket(address, true);
+  if (listener < 0) {
+    fprintf(stderr, "Cannot listen on %s\n", argv[2]);
+    return 1;
+  }
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+
+  printf("Serving %zu -> %zu on %s, max batch %zu, max delay %ld us, "
+         "%zu workers\n",
+         net.inputs(), net.outputs(), argv[2],
+         options.maxBatch, options.maxDelayUs, options.workers);
+  fflush(stdout);
+
+  Server server(net, options);
+  int status = server.run(listener);
+
+  if (address.isUnix)
+    unlink(address.path.c_str());
+
+  return status;
+}